@@ -0,0 +1,519 @@
+/*
+ *
+ * bench.c
+ *
+ * Microbenchmarks of the macro-processor's internals.
+ * process.c is included directly, so its static functions can be driven in isolation.
+ *
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "../process.c"
+
+#include <stdint.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+	#include <x86intrin.h>
+	#define BENCH_UNIT "cycles"
+#else
+	#define BENCH_UNIT "ns"
+#endif
+
+#define BENCH_WARMUP  16
+#define BENCH_SAMPLES 201
+#define BENCH_MIN_TICKS 50000 // minimum length of a single sample
+
+/*
+ *
+ * Timing
+ *
+ */
+
+static inline uint64_t bench_ticks (void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	_mm_lfence();
+	uint64_t t = __rdtsc();
+	_mm_lfence();
+	return t;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+#endif
+}
+
+// runs 'iters' operations
+typedef void (*bench_Fn) (size_t iters);
+// cleans up after a sample, outside of the timed region
+typedef void (*bench_Reset) (void);
+
+static int cmp_double (const void* a, const void* b)
+{
+	double x = *(const double*)a;
+	double y = *(const double*)b;
+	return (x > y) - (x < y);
+}
+
+static double sample (bench_Fn fn, bench_Reset reset, size_t iters)
+{
+	uint64_t start = bench_ticks();
+	fn(iters);
+	double ticks = (double)(bench_ticks() - start) / iters;
+	if (reset != NULL)
+		reset();
+	return ticks;
+}
+
+/*
+ *
+ * Run the benchmark, print median and percentiles of ticks per operation
+ * 'reset' (if not NULL) runs after every sample
+ *
+ */
+static void bench_run_reset (const char* name, bench_Fn fn, bench_Reset reset)
+{
+	// calibrate, so a single sample isn't dominated by the timer
+	size_t iters = 1;
+	while (iters < ((size_t)1 << 30)) {
+		uint64_t start = bench_ticks();
+		fn(iters);
+		uint64_t ticks = bench_ticks() - start;
+		if (reset != NULL)
+			reset();
+		if (ticks >= BENCH_MIN_TICKS)
+			break;
+		iters *= 2;
+	}
+
+	for (int i = 0; i < BENCH_WARMUP; i++)
+		sample(fn, reset, iters);
+
+	static double samples[BENCH_SAMPLES];
+	for (int i = 0; i < BENCH_SAMPLES; i++)
+		samples[i] = sample(fn, reset, iters);
+	qsort(samples, BENCH_SAMPLES, sizeof(*samples), cmp_double);
+
+	printf("%-24s %10.2f %10.2f %10.2f %10.2f %10zu\n",
+		name,
+		samples[0],
+		samples[BENCH_SAMPLES / 2],
+		samples[BENCH_SAMPLES * 90 / 100],
+		samples[BENCH_SAMPLES * 99 / 100],
+		iters
+	);
+}
+
+static void bench_run (const char* name, bench_Fn fn)
+{
+	bench_run_reset(name, fn, NULL);
+}
+
+/*
+ *
+ * Inputs
+ *
+ */
+
+#define TEXT_LEN (64 * 1024)
+#define TABLE_SIZE 256
+
+static struct mp_ProcessEnv pe;
+static char text[TEXT_LEN + 1];
+static char defs[TABLE_SIZE * 64];
+static const char* call_obj = "OBJ;";
+static const char* call_func = "FN(12, 35);";
+static const char* tmpfn = "bench_input.tmp";
+static char filebuff[TEXT_LEN + 1];
+static volatile size_t sink;
+
+// lines of words, numbers and punctuation
+static void make_text (void)
+{
+	static const char* words[] = { "alpha", "beta_2", "gamma", "x", "delta_epsilon", "(1, 2);", "zeta" };
+	size_t len = 0;
+	for (size_t i = 0; len < TEXT_LEN; i++) {
+		const char* w = words[i % (sizeof(words) / sizeof(*words))];
+		while (*w && len < TEXT_LEN)
+			text[len++] = *w++;
+		if (len < TEXT_LEN)
+			text[len++] = (i % 8 == 7) ? '\n' : ' ';
+	}
+	text[TEXT_LEN] = '\0';
+}
+
+// TABLE_SIZE object-like definitions, plus OBJ and FN
+static void make_table (void)
+{
+	size_t len = 0;
+	for (size_t i = 0; i < TABLE_SIZE; i++)
+		len += sprintf(&defs[len], "#define macro_%zu %zu\n", i, i);
+	len += sprintf(&defs[len], "#define OBJ hello world\n#define FN(a,b) a + b\n");
+
+	mp_PE_init(&pe, defs, "bench", len, 0, MP_ENDCH_NONE);
+	if (mp_process(&pe) == MP_BAD)
+		exit(EXIT_FAILURE);
+}
+
+static void set_src (const char* src, size_t len)
+{
+	pe.ctx.src = src;
+	pe.ctx.readlen = len;
+	pe.ctx.out = &pe.out;
+	pe.ctx.endch = MP_ENDCH_NONE;
+	pe.ctx.nl = detect_newlines(src, len);
+	pe.ctx.istop = MP_TRUE;
+	PE_reset_state(&pe);
+}
+
+/*
+ *
+ * Benchmarks
+ *
+ */
+
+static void bench_advance (size_t iters)
+{
+	for (size_t i = 0; i < iters; i++) {
+		if (pe.state.eof)
+			PE_reset_state(&pe);
+		sink += PE_advance(&pe);
+	}
+}
+
+static void bench_word (size_t iters)
+{
+	for (size_t i = 0; i < iters; i++) {
+		if (pe.state.eof)
+			PE_reset_state(&pe);
+		PE_word(&pe);
+		PE_advance(&pe);
+		sink += pe.state.wlen;
+	}
+}
+
+static void bench_find_hit (size_t iters)
+{
+	for (size_t i = 0; i < iters; i++)
+		sink += (size_t)PE_find_macro(&pe, "macro_128", 9);
+}
+
+static void bench_find_miss (size_t iters)
+{
+	for (size_t i = 0; i < iters; i++)
+		sink += (size_t)PE_find_macro(&pe, "unknown", 7);
+}
+
+// open addressing table of the same definitions, for comparison with the HAMT
+#define FLAT_SIZE 1024
+static struct mp_Macro* flat[FLAT_SIZE];
+
+static void make_flat_table (void)
+{
+	for (size_t i = 0; i < pe.macrostop; i++) {
+		struct mp_Macro* macro = &pe.macros[i];
+		size_t j = mp_hamt_hash(macro->name, macro->namelen) % FLAT_SIZE;
+		while (flat[j] != NULL)
+			j = (j + 1) % FLAT_SIZE;
+		flat[j] = macro;
+	}
+}
+
+static struct mp_Macro* flat_find (const char* name, size_t len)
+{
+	for (size_t j = mp_hamt_hash(name, len) % FLAT_SIZE; flat[j] != NULL; j = (j + 1) % FLAT_SIZE)
+		if (mp_cstr_eq(name, len, flat[j]->name, flat[j]->namelen) == MP_TRUE)
+			return flat[j];
+	return NULL;
+}
+
+static void bench_flat_hit (size_t iters)
+{
+	for (size_t i = 0; i < iters; i++)
+		sink += (size_t)flat_find("macro_128", 9);
+}
+
+// path copy of a redefinition, the old versions are kept
+static void bench_redefine (size_t iters)
+{
+	struct mp_Macro* macro = PE_find_def(&pe, "macro_128", 9);
+	for (size_t i = 0; i < iters; i++)
+		if (mp_hamt_set(&pe.defs, &pe.hamtnodes, macro) == MP_BAD)
+			exit(EXIT_FAILURE);
+	sink += pe.defs.count;
+}
+
+static void bench_cstr_eq (size_t iters)
+{
+	static const char* a = "some_identifier_";
+	static const char* b = "some_identifier_";
+	for (size_t i = 0; i < iters; i++)
+		sink += mp_cstr_eq(a, 16, b, 16);
+}
+
+static void bench_expand (size_t iters, const char* call, size_t namelen)
+{
+	struct mp_Macro* macro = PE_find_macro(&pe, call, namelen);
+	for (size_t i = 0; i < iters; i++) {
+		set_src(call, strlen(call));
+		pe.state.srcofs = namelen;
+		if (PE_expand_macro(&pe, macro) == MP_BAD)
+			exit(EXIT_FAILURE);
+		sink += pe.state.rope->len;
+	}
+}
+
+// drop the expansion results
+static void reset_ropes (void)
+{
+	while (pe.ropes != NULL) {
+		struct mp_Rope* next = pe.ropes->next;
+		mp_rope_free(pe.ropes);
+		free(pe.ropes);
+		pe.ropes = next;
+	}
+}
+
+static void bench_expand_obj (size_t iters)
+{
+	bench_expand(iters, call_obj, 3);
+}
+
+static void bench_expand_func (size_t iters)
+{
+	bench_expand(iters, call_func, 2);
+}
+
+// checkpoint, define CHECKPOINT_DEFS names and look them up, then roll back
+// without giving the slots back, this runs out of them after a few hundred operations
+#define CHECKPOINT_DEFS 8
+static char ckdefs[CHECKPOINT_DEFS * 32];
+static size_t ckdefslen;
+
+static void make_checkpoint_defs (void)
+{
+	for (size_t i = 0; i < CHECKPOINT_DEFS; i++)
+		ckdefslen += sprintf(&ckdefs[ckdefslen], "#define ck_%zu(a) a %zu\n", i, i);
+}
+
+static void bench_checkpoint (size_t iters)
+{
+	for (size_t i = 0; i < iters; i++) {
+		struct mp_Snapshot snap = mp_PE_snapshot(&pe);
+		set_src(ckdefs, ckdefslen);
+		if (
+			(mp_process(&pe) == MP_BAD) ||
+			(PE_find_def(&pe, "ck_7", 4) == NULL)
+		) exit(EXIT_FAILURE);
+		mp_PE_restore(&pe, &snap);
+		if (PE_find_def(&pe, "ck_7", 4) != NULL)
+			exit(EXIT_FAILURE);
+		sink += pe.macrostop;
+	}
+}
+
+// drop the output
+static void reset_out (void)
+{
+	mp_rope_free(&pe.out);
+	mp_rope_init(&pe.out);
+}
+
+// TABLE_SIZES[i] definitions, none of them used in 'text'
+static const size_t TABLE_SIZES[] = { 16, 256, 4000 };
+static struct mp_ProcessEnv scanpe;
+static char* scandefs;
+
+static void make_scan_table (size_t size)
+{
+	free(scandefs);
+	scandefs = malloc(size * 64);
+	size_t len = 0;
+	for (size_t i = 0; i < size; i++)
+		len += sprintf(&scandefs[len], "#define name_%zu_%c %zu\n", i, 'a' + (int)(i % 26), i);
+
+	mp_PE_init(&scanpe, scandefs, "bench", len, 0, MP_ENDCH_NONE);
+	if (
+		(mp_process(&scanpe) == MP_BAD) ||
+		(PE_update_scanner(&scanpe) == MP_BAD)
+	) exit(EXIT_FAILURE);
+}
+
+// per-word lookup of the whole text
+static void bench_scan_lookup (size_t iters)
+{
+	for (size_t n = 0; n < iters; n++)
+		for (size_t i = 0; i < TEXT_LEN;) {
+			if (!is_wordbegc(text[i])) {
+				i++;
+				continue;
+			}
+			size_t wlen = cstr_wordlen(&text[i], TEXT_LEN - i);
+			sink += (size_t)PE_find_def(&scanpe, &text[i], wlen);
+			i += wlen;
+		}
+}
+
+// scanner over the whole text
+static void bench_scan_scanner (size_t iters)
+{
+	for (size_t n = 0; n < iters; n++)
+		for (size_t i = 0; i < TEXT_LEN;)
+			i = mp_scanner_next(&scanpe.scanner, text, TEXT_LEN, i) + 1;
+}
+
+// SMALL_FILES sources of SMALL_LEN bytes, each read and written back through a batch
+#define SMALL_FILES 64
+#define SMALL_LEN 2048
+static char smallsrc[SMALL_FILES][32];
+static char smallout[SMALL_FILES][32];
+static struct mp_Batch batch;
+
+static void make_small_files (void)
+{
+	for (size_t i = 0; i < SMALL_FILES; i++) {
+		sprintf(smallsrc[i], "bench_small_%zu.tmp", i);
+		sprintf(smallout[i], "bench_small_%zu.out.tmp", i);
+		if (mp_file_write(NULL, smallsrc[i], &text[i * 64], SMALL_LEN) == MP_BAD)
+			exit(EXIT_FAILURE);
+	}
+}
+
+static void remove_small_files (void)
+{
+	for (size_t i = 0; i < SMALL_FILES; i++) {
+		remove(smallsrc[i]);
+		remove(smallout[i]);
+	}
+}
+
+// one operation: every small file, like mp.c reads ahead and writes
+static void bench_small_files (size_t iters)
+{
+	static struct mp_FileReq reqs[SMALL_FILES];
+	for (size_t n = 0; n < iters; n++) {
+		size_t readc = 0;
+		for (size_t i = 0; i < SMALL_FILES; i++) {
+			for (; (readc < SMALL_FILES) && (readc <= i + MP_IO_PREFETCH); readc++)
+				mp_batch_read(&batch, &reqs[readc], smallsrc[readc]);
+			char* buff;
+			long flen;
+			if (mp_batch_wait_read(&batch, &reqs[i], &buff, &flen) == MP_BAD)
+				exit(EXIT_FAILURE);
+			struct mp_Rope rope;
+			mp_rope_init(&rope);
+			if (
+				(mp_rope_append_str(&rope, buff, flen) == MP_BAD) ||
+				(mp_batch_write_rope(&batch, smallout[i], &rope) == MP_BAD)
+			) exit(EXIT_FAILURE);
+			mp_rope_free(&rope);
+			free(buff);
+		}
+		if (mp_batch_flush(&batch) == MP_BAD)
+			exit(EXIT_FAILURE);
+	}
+}
+
+// 'text' with "\r\n" line endings
+static char crlftext[TEXT_LEN * 2];
+static size_t crlflen;
+
+static void make_crlf_text (void)
+{
+	for (size_t i = 0; i < TEXT_LEN; i++) {
+		if (text[i] == '\n')
+			crlftext[crlflen++] = '\r';
+		crlftext[crlflen++] = text[i];
+	}
+}
+
+static void bench_lines (size_t iters, const char* src, size_t len, int nl)
+{
+	for (size_t i = 0; i < iters; i++) {
+		size_t ln = 1;
+		size_t lnsidx = 0;
+		count_lines(src, 0, len, nl, &ln, &lnsidx);
+		sink += ln + lnsidx;
+	}
+}
+
+static void bench_lines_lf (size_t iters)
+{
+	bench_lines(iters, text, TEXT_LEN, MP_NL_LF);
+}
+
+static void bench_lines_crlf (size_t iters)
+{
+	bench_lines(iters, crlftext, crlflen, MP_NL_CRLF);
+}
+
+// general loop, on the LF text
+static void bench_lines_mixed (size_t iters)
+{
+	bench_lines(iters, text, TEXT_LEN, MP_NL_MIXED);
+}
+
+static void bench_file_read (size_t iters)
+{
+	for (size_t i = 0; i < iters; i++)
+		if (mp_file_read(NULL, tmpfn, filebuff, NULL, NULL, 0, TEXT_LEN, MP_TRUE) == MP_BAD)
+			exit(EXIT_FAILURE);
+}
+
+int main (void)
+{
+	make_text();
+	make_table();
+	if (mp_file_write(NULL, tmpfn, text, TEXT_LEN) == MP_BAD)
+		return EXIT_FAILURE;
+
+	printf("%-24s %10s %10s %10s %10s %10s\n", BENCH_UNIT "/op", "min", "median", "p90", "p99", "iters");
+
+	set_src(text, TEXT_LEN);
+	bench_run("PE_advance", bench_advance);
+	set_src(text, TEXT_LEN);
+	bench_run("PE_word", bench_word);
+	bench_run("PE_find_macro (hit)", bench_find_hit);
+	bench_run("PE_find_macro (miss)", bench_find_miss);
+	make_flat_table();
+	bench_run("flat hash table (hit)", bench_flat_hit);
+	bench_run("mp_hamt_set (redefine)", bench_redefine);
+	bench_run("mp_cstr_eq", bench_cstr_eq);
+	bench_run_reset("PE_expand_macro (obj)", bench_expand_obj, reset_ropes);
+	bench_run_reset("PE_expand_macro (func)", bench_expand_func, reset_ropes);
+	make_checkpoint_defs();
+	bench_run_reset("snapshot/restore (8 defs)", bench_checkpoint, reset_out);
+	bench_run("mp_file_read (64K)", bench_file_read);
+
+	make_crlf_text();
+	bench_run("count_lines 64K (LF)", bench_lines_lf);
+	bench_run("count_lines 64K (CRLF)", bench_lines_crlf);
+	bench_run("count_lines 64K (mixed)", bench_lines_mixed);
+
+	make_small_files();
+	mp_batch_init(&batch, 0);
+	bench_run("64 files, buffered", bench_small_files);
+	mp_batch_free(&batch);
+	mp_batch_init(&batch, MP_IO_DEPTH);
+	if (batch.ring != NULL)
+		bench_run("64 files, io_uring", bench_small_files);
+	else printf("64 files, io_uring: unavailable\n");
+	mp_batch_free(&batch);
+	remove_small_files();
+
+	for (size_t i = 0; i < sizeof(TABLE_SIZES) / sizeof(*TABLE_SIZES); i++) {
+		char name[64];
+		make_scan_table(TABLE_SIZES[i]);
+		sprintf(name, "lookup/word 64K (%zu)", TABLE_SIZES[i]);
+		bench_run(name, bench_scan_lookup);
+		sprintf(name, "scanner 64K (%zu)", TABLE_SIZES[i]);
+		bench_run(name, bench_scan_scanner);
+		mp_PE_free_all(&scanpe);
+	}
+	free(scandefs);
+
+	remove(tmpfn);
+	mp_PE_free_all(&pe);
+	return 0;
+}
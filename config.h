@@ -10,8 +10,8 @@
 
 #define MP_INSTRUCTION_PREFIX '#'
 #define MP_MAX_MACROS 4096
-#define MP_MAX_MACRO_EXPS 8192
-#define MP_MAX_DEF_LEN 5000
+#define MP_IO_DEPTH 32 // file requests in flight with io_uring, 0 disables it
+#define MP_IO_PREFETCH 8 // sources read ahead of the one being processed
 
 
 #endif // MP_CONFIG_H
\ No newline at end of file
@@ -6,11 +6,20 @@
  * 
  */
 
+#define _GNU_SOURCE // copy_file_range
+
 #include "mp.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 
+#ifdef __linux__
+	#include <fcntl.h>
+	#include <unistd.h>
+	#include <sys/stat.h>
+	#include <sys/sendfile.h>
+#endif
+
 /*
  *
  * Read the file into a buffer.
@@ -113,6 +122,48 @@ close_file:
 	return ret;
 }
 
+#ifdef __linux__
+/*
+ *
+ * Open 'filename' for writing 'len' bytes from the start
+ * The file is only cut if it's longer, truncating it to 0 first costs more than writing a small file.
+ * returns file descriptor, or -1
+ *
+ */
+static int open_out (const char* filename, size_t len)
+{
+	int fd = open(filename, O_WRONLY | O_CREAT, 0666);
+	if (fd == -1)
+		return -1;
+	struct stat st;
+	if (
+		(fstat(fd, &st) != 0) ||
+		((st.st_size > (off_t)len) && (ftruncate(fd, len) != 0))
+	) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+#endif
+
+// fopen(filename, "wb"), see open_out()
+static FILE* fopen_out (const char* filename, size_t len)
+{
+#ifdef __linux__
+	int fd = open_out(filename, len);
+	if (fd == -1)
+		return NULL;
+	FILE* f = fdopen(fd, "wb");
+	if (f == NULL)
+		close(fd);
+	return f;
+#else
+	(void)len;
+	return fopen(filename, "wb");
+#endif
+}
+
 /*
  *
  * Write the buffer into the file
@@ -130,7 +181,7 @@ int mp_file_write (
 			MP_PRINT_ERROR("Failed to write to file \"%s\": no file stream or filename provided", filename);
 			return MP_BAD;
 		}
-		f = fopen(filename, "wb");
+		f = fopen_out(filename, len);
 		if (f == NULL) {
 			MP_PRINT_ERROR("Failed to open file \"%s\" for writing", filename);
 			return MP_BAD;
@@ -153,4 +204,550 @@ int mp_file_write (
 	}
 
 	return ret;
+}
+
+// write the rope's spans into the file stream
+static MP_BOOL write_rope (FILE* f, const struct mp_Rope* rope)
+{
+	for (size_t i = 0; i < rope->spanc; i++) {
+		const struct mp_Span* span = &rope->spans[i];
+		if (span->str != NULL) {
+			if (fwrite(span->str, sizeof(char), span->len, f) != span->len)
+				return MP_FALSE;
+		}
+		else if (write_rope(f, span->rope) == MP_FALSE)
+			return MP_FALSE;
+	}
+	return MP_TRUE;
+}
+
+/*
+ *
+ * Write the rope into the file, flattening it on the way
+ *
+ */
+int mp_file_write_rope (
+	FILE* f,						// if NULL, file opened with 'filename'
+	const char* filename,			// if NULL, file opened with 'f'
+	const struct mp_Rope* rope		// rope to write
+) {
+	// no file stream specified, try to open a file using the given filename
+	if (f == NULL) {
+		if (filename == NULL) {
+			MP_PRINT_ERROR("Failed to write to file \"%s\": no file stream or filename provided", filename);
+			return MP_BAD;
+		}
+		f = fopen_out(filename, rope->len);
+		if (f == NULL) {
+			MP_PRINT_ERROR("Failed to open file \"%s\" for writing", filename);
+			return MP_BAD;
+		}
+	}
+
+	int ret = MP_OK;
+
+	// write rope contents into the file
+	if (write_rope(f, rope) == MP_FALSE) {
+		MP_PRINT_ERROR("Failed to properly write to file \"%s\"", filename);
+		ret = MP_BAD;
+	}
+
+	// close the file, if opened by this function
+	if (filename != NULL)
+	if (fclose(f) == EOF) {
+		MP_PRINT_ERROR("Failed to close file \"%s\"", filename);
+		return MP_BAD;
+	}
+
+	return ret;
+}
+
+
+#ifdef __linux__
+// copy 'len' bytes between the files in kernel space
+static MP_BOOL copy_fd (int in, int out, size_t len)
+{
+	MP_BOOL usesendfile = MP_FALSE;
+	while (len > 0) {
+		ssize_t n = -1;
+		if (usesendfile == MP_FALSE) {
+			n = copy_file_range(in, NULL, out, NULL, len, 0);
+			if (n <= 0) // unsupported between these files
+				usesendfile = MP_TRUE;
+		}
+		if (usesendfile == MP_TRUE)
+			n = sendfile(out, in, NULL, len);
+		if (n <= 0)
+			return MP_FALSE;
+		len -= n;
+	}
+	return MP_TRUE;
+}
+#endif
+
+/*
+ *
+ * Copy the file 'srcfn' (of length 'len') to 'outfn'.
+ * 'buff' holds the same contents, written in bulk if the kernel can't copy the file.
+ *
+ */
+int mp_file_copy (
+	const char* srcfn,
+	const char* outfn,
+	const char* buff,
+	size_t len
+) {
+#ifdef __linux__
+	int in = open(srcfn, O_RDONLY);
+	if (in != -1) {
+		int out = open_out(outfn, len);
+		if (out == -1) {
+			close(in);
+			MP_PRINT_ERROR("Failed to open file \"%s\" for writing", outfn);
+			return MP_BAD;
+		}
+		MP_BOOL copied = copy_fd(in, out, len);
+		close(in);
+		if (close(out) != 0) {
+			MP_PRINT_ERROR("Failed to close file \"%s\"", outfn);
+			return MP_BAD;
+		}
+		if (copied == MP_TRUE)
+			return MP_OK;
+		// otherwise rewritten from the start below
+	}
+#else
+	(void)srcfn;
+#endif
+	return mp_file_write(NULL, outfn, buff, len);
+}
+
+/*
+ *
+ * Batched I/O
+ * With io_uring, sources are read ahead of time and outputs are written in the background,
+ * otherwise every request goes through the buffered functions above once it's needed.
+ *
+ */
+
+#ifdef MP_HAVE_URING
+#define BATCH_CHUNK (1u << 30) // largest single read/write
+#define BATCH_MAX_COPY (1u << 20) // larger outputs are written right away, copying them costs more than the overlap saves
+
+static void batch_unlink (struct mp_FileReq** list, struct mp_FileReq* req)
+{
+	for (; *list != NULL; list = &(*list)->next)
+		if (*list == req) {
+			*list = req->next;
+			return;
+		}
+}
+
+// queue the rest of the request
+static int batch_queue (struct mp_Batch* batch, struct mp_FileReq* req)
+{
+	size_t len = req->len - req->done;
+	if (len > BATCH_CHUNK)
+		len = BATCH_CHUNK;
+	for (int tries = 0; tries < 2; tries++) {
+		int ret = (req->iswrite == MP_TRUE)
+			? mp_ring_write(batch->ring, req->fd, req->buff + req->done, len, req->done, (uintptr_t)req)
+			: mp_ring_read(batch->ring, req->fd, req->buff + req->done, len, req->done, (uintptr_t)req);
+		if (ret == MP_OK) {
+			batch->inflight++;
+			return mp_ring_submit(batch->ring, 0);
+		}
+		if (mp_ring_submit(batch->ring, 0) == MP_BAD) // submission queue full
+			break;
+	}
+	return MP_BAD;
+}
+
+// the request is finished, successfully or not
+static void batch_done (struct mp_Batch* batch, struct mp_FileReq* req, int state)
+{
+	if (
+		(close(req->fd) != 0) &&
+		(req->iswrite == MP_TRUE)
+	) {
+		MP_PRINT_ERROR("Failed to close file \"%s\"", req->filename);
+		state = MP_REQ_FAILED;
+	}
+	req->fd = -1;
+	req->state = state;
+	if (req->iswrite == MP_TRUE) {
+		batch_unlink(&batch->writes, req);
+		if (req->ownsbuff == MP_TRUE)
+			free(req->buff);
+		free(req);
+	}
+}
+
+static void batch_complete (struct mp_Batch* batch, struct mp_FileReq* req, int res)
+{
+	batch->inflight--;
+	if (res > 0)
+		req->done += res;
+	if (
+		(res < 0) ||
+		((res == 0) && (req->done < req->len)) || // file shrunk since
+		((req->done < req->len) && (batch_queue(batch, req) == MP_BAD))
+	) {
+		if (req->iswrite == MP_TRUE)
+			MP_PRINT_ERROR("Failed to properly write to file \"%s\"", req->filename);
+		else
+			MP_PRINT_ERROR("Failed to properly read file \"%s\"", req->filename);
+		batch_done(batch, req, MP_REQ_FAILED);
+	}
+	else if (req->done == req->len)
+		batch_done(batch, req, MP_REQ_DONE);
+}
+
+// submit queued requests and handle completions, waiting for at least one if 'wait'
+static int batch_reap (struct mp_Batch* batch, MP_BOOL wait)
+{
+	if (mp_ring_submit(batch->ring, (wait == MP_TRUE) ? 1 : 0) == MP_BAD) {
+		MP_PRINT_ERROR("Failed to wait for file I/O");
+		return MP_BAD;
+	}
+	uint64_t tag;
+	int res;
+	while (mp_ring_reap(batch->ring, &tag, &res) == MP_TRUE)
+		batch_complete(batch, (struct mp_FileReq*)(uintptr_t)tag, res);
+	return MP_OK;
+}
+
+// make room for another request in flight
+static int batch_reserve (struct mp_Batch* batch)
+{
+	while (batch->inflight >= batch->depth)
+		if (batch_reap(batch, MP_TRUE) == MP_BAD)
+			return MP_BAD;
+	return MP_OK;
+}
+
+/*
+ *
+ * Open 'filename' for writing 'len' bytes, once the earlier writes into the same file are done.
+ * Sources read ahead from the same file are marked stale.
+ * returns file descriptor and sets *st, or -1
+ *
+ */
+static int batch_open_out (struct mp_Batch* batch, const char* filename, size_t len, struct stat* st)
+{
+	int fd = open(filename, O_WRONLY | O_CREAT, 0666);
+	if (fd == -1) {
+		MP_PRINT_ERROR("Failed to open file \"%s\" for writing", filename);
+		return -1;
+	}
+	if (fstat(fd, st) != 0) {
+		MP_PRINT_ERROR("Failed to open file \"%s\" for writing", filename);
+		close(fd);
+		return -1;
+	}
+
+	for (struct mp_FileReq* req = batch->reads; req != NULL; req = req->next)
+		if (
+			(req->dev == (uint64_t)st->st_dev) &&
+			(req->ino == (uint64_t)st->st_ino)
+		) req->stale = MP_TRUE;
+
+	MP_BOOL waited = MP_FALSE;
+	struct mp_FileReq* req = batch->writes;
+	while (req != NULL) {
+		if (
+			(req->dev == (uint64_t)st->st_dev) &&
+			(req->ino == (uint64_t)st->st_ino)
+		) {
+			waited = MP_TRUE;
+			if (batch_reap(batch, MP_TRUE) == MP_BAD)
+				break;
+			req = batch->writes; // changed, start over
+		}
+		else req = req->next;
+	}
+
+	// only cut if longer, see open_out(); the writes waited for may have made it longer
+	if (
+		((waited == MP_TRUE) && (fstat(fd, st) != 0)) ||
+		((st->st_size > (off_t)len) && (ftruncate(fd, len) != 0))
+	) {
+		MP_PRINT_ERROR("Failed to open file \"%s\" for writing", filename);
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+// write 'buff' into the file in the background, 'buff' is freed afterwards if 'ownsbuff'
+static int batch_write (struct mp_Batch* batch, const char* filename, char* buff, size_t len, MP_BOOL ownsbuff)
+{
+	struct stat st;
+	int fd = batch_open_out(batch, filename, len, &st);
+	struct mp_FileReq* req = NULL;
+	if (
+		(fd != -1) &&
+		(len > 0)
+	) {
+		// the filename doesn't have to outlive the call
+		size_t fnlen = strlen(filename);
+		req = malloc(sizeof(*req) + fnlen + 1);
+		if (req == NULL)
+			MP_PRINT_ERROR("Out of memory while writing file \"%s\"", filename);
+		else memcpy(req + 1, filename, fnlen + 1);
+	}
+	if (req == NULL) {
+		int ret = ((fd != -1) && (len == 0)) ? MP_OK : MP_BAD;
+		if (
+			(fd != -1) &&
+			(close(fd) != 0)
+		) {
+			MP_PRINT_ERROR("Failed to close file \"%s\"", filename);
+			ret = MP_BAD;
+		}
+		if (ownsbuff == MP_TRUE)
+			free(buff);
+		return ret;
+	}
+
+	req->filename = (const char*)(req + 1);
+	req->fd = fd;
+	req->buff = buff;
+	req->len = len;
+	req->done = 0;
+	req->state = MP_REQ_PENDING;
+	req->iswrite = MP_TRUE;
+	req->ownsbuff = ownsbuff;
+	req->stale = MP_FALSE;
+	req->dev = st.st_dev;
+	req->ino = st.st_ino;
+	req->next = batch->writes;
+	batch->writes = req;
+
+	if (
+		(batch_reserve(batch) == MP_BAD) ||
+		(batch_queue(batch, req) == MP_BAD)
+	) {
+		MP_PRINT_ERROR("Failed to properly write to file \"%s\"", filename);
+		batch_done(batch, req, MP_REQ_FAILED);
+		return MP_BAD;
+	}
+	return MP_OK;
+}
+#endif // MP_HAVE_URING
+
+// 'depth' of 0 disables io_uring
+void mp_batch_init (struct mp_Batch* batch, unsigned depth)
+{
+	batch->ring = NULL;
+	batch->depth = depth;
+	batch->inflight = 0;
+	batch->reads = NULL;
+	batch->writes = NULL;
+#ifdef MP_HAVE_URING
+	if (depth > 0)
+		batch->ring = mp_ring_new(depth);
+#endif
+}
+
+// finishes the writes, drops the sources not waited for
+void mp_batch_free (struct mp_Batch* batch)
+{
+	mp_batch_flush(batch);
+#ifdef MP_HAVE_URING
+	if (batch->ring == NULL)
+		return;
+	while (
+		(batch->inflight > 0) &&
+		(batch_reap(batch, MP_TRUE) == MP_OK)
+	);
+	mp_ring_free(batch->ring); // cancels anything still in flight
+	batch->ring = NULL;
+	for (struct mp_FileReq* req = batch->reads; req != NULL; req = req->next) {
+		free(req->buff);
+		req->buff = NULL;
+		if (req->fd != -1)
+			close(req->fd);
+		req->fd = -1;
+	}
+	batch->reads = NULL;
+#endif
+}
+
+/*
+ *
+ * Start reading the file, see mp_batch_wait_read()
+ * 'filename' has to outlive the request.
+ *
+ */
+void mp_batch_read (struct mp_Batch* batch, struct mp_FileReq* req, const char* filename)
+{
+	req->filename = filename;
+	req->fd = -1;
+	req->buff = NULL;
+	req->len = 0;
+	req->done = 0;
+	req->state = MP_REQ_IDLE;
+	req->iswrite = MP_FALSE;
+	req->ownsbuff = MP_TRUE;
+	req->stale = MP_FALSE;
+	req->dev = 0;
+	req->ino = 0;
+	req->next = NULL;
+#ifdef MP_HAVE_URING
+	if (batch->ring == NULL)
+		return;
+
+	// anything unusual is left to the buffered path, which reports the errors
+	req->fd = open(filename, O_RDONLY);
+	if (req->fd == -1)
+		return;
+	struct stat st;
+	if (
+		(fstat(req->fd, &st) != 0) ||
+		(!S_ISREG(st.st_mode)) ||
+		((req->buff = malloc(st.st_size + 1)) == NULL)
+	) {
+		close(req->fd);
+		req->fd = -1;
+		return;
+	}
+	// an output still being written into the file, read it once that's done
+	for (struct mp_FileReq* w = batch->writes; w != NULL; w = w->next)
+		if (
+			(w->dev == (uint64_t)st.st_dev) &&
+			(w->ino == (uint64_t)st.st_ino)
+		) {
+			free(req->buff);
+			req->buff = NULL;
+			close(req->fd);
+			req->fd = -1;
+			return;
+		}
+
+	req->len = st.st_size;
+	req->buff[req->len] = '\0';
+	req->dev = st.st_dev;
+	req->ino = st.st_ino;
+	req->next = batch->reads;
+	batch->reads = req;
+
+	if (req->len == 0) {
+		batch_done(batch, req, MP_REQ_DONE);
+		return;
+	}
+	req->state = MP_REQ_PENDING;
+	if (
+		(batch_reserve(batch) == MP_BAD) ||
+		(batch_queue(batch, req) == MP_BAD)
+	) {
+		batch_unlink(&batch->reads, req);
+		free(req->buff);
+		req->buff = NULL;
+		close(req->fd);
+		req->fd = -1;
+		req->state = MP_REQ_IDLE;
+	}
+#else
+	(void)batch;
+#endif
+}
+
+/*
+ *
+ * Finish reading the file started with mp_batch_read()
+ * *buff is allocated and null terminated, like with mp_file_read()
+ *
+ */
+int mp_batch_wait_read (struct mp_Batch* batch, struct mp_FileReq* req, char** buff, long* flen)
+{
+#ifdef MP_HAVE_URING
+	if (batch->ring != NULL) {
+		while (req->state == MP_REQ_PENDING)
+			if (batch_reap(batch, MP_TRUE) == MP_BAD)
+				return MP_BAD;
+		if (req->state != MP_REQ_IDLE)
+			batch_unlink(&batch->reads, req);
+		if (
+			(req->state == MP_REQ_DONE) &&
+			(req->stale == MP_FALSE)
+		) {
+			*buff = req->buff;
+			*flen = req->len;
+			req->buff = NULL;
+			return MP_OK;
+		}
+		free(req->buff);
+		req->buff = NULL;
+		if (req->state == MP_REQ_FAILED)
+			return MP_BAD;
+		// the file may be an output still being written
+		if (mp_batch_flush(batch) == MP_BAD)
+			return MP_BAD;
+	}
+#else
+	(void)batch;
+#endif
+	return mp_file_read(NULL, req->filename, NULL, buff, flen, 0, 0, MP_TRUE);
+}
+
+// write the rope into the file
+int mp_batch_write_rope (struct mp_Batch* batch, const char* filename, const struct mp_Rope* rope)
+{
+#ifdef MP_HAVE_URING
+	if (
+		(batch->ring != NULL) &&
+		(rope->len > BATCH_MAX_COPY)
+	) {
+		struct stat st;
+		int fd = batch_open_out(batch, filename, rope->len, &st);
+		if (fd == -1)
+			return MP_BAD;
+		FILE* f = fdopen(fd, "wb");
+		if (f == NULL) {
+			MP_PRINT_ERROR("Failed to open file \"%s\" for writing", filename);
+			close(fd);
+			return MP_BAD;
+		}
+		return mp_file_write_rope(f, filename, rope);
+	}
+	if (batch->ring != NULL) {
+		char* buff = malloc(rope->len + 1);
+		if (buff == NULL) {
+			MP_PRINT_ERROR("Out of memory while writing file \"%s\"", filename);
+			return MP_BAD;
+		}
+		mp_rope_flatten(rope, buff);
+		return batch_write(batch, filename, buff, rope->len, MP_TRUE);
+	}
+#else
+	(void)batch;
+#endif
+	return mp_file_write_rope(NULL, filename, rope);
+}
+
+// copy the file, see mp_file_copy(); with io_uring 'buff' is written, and has to outlive the batch
+int mp_batch_copy (struct mp_Batch* batch, const char* srcfn, const char* outfn, const char* buff, size_t len)
+{
+#ifdef MP_HAVE_URING
+	if (batch->ring != NULL)
+		return batch_write(batch, outfn, (char*)buff, len, MP_FALSE);
+#else
+	(void)batch;
+#endif
+	return mp_file_copy(srcfn, outfn, buff, len);
+}
+
+// wait for the writes to finish
+int mp_batch_flush (struct mp_Batch* batch)
+{
+#ifdef MP_HAVE_URING
+	if (batch->ring != NULL)
+		while (batch->writes != NULL)
+			if (batch_reap(batch, MP_TRUE) == MP_BAD)
+				return MP_BAD;
+#else
+	(void)batch;
+#endif
+	return MP_OK;
 }
\ No newline at end of file
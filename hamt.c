@@ -0,0 +1,239 @@
+/*
+ *
+ * hamt.c
+ *
+ * Persistent hash array mapped trie of definitions, by name.
+ *
+ * Every node maps HAMT_BITS bits of the name's hash to its slots, storing only the occupied ones.
+ * Nodes are never modified once built: setting a name copies the path to its slot (O(log n) nodes),
+ * and shares the rest with the previous version, so any version of the table stays valid,
+ * and a snapshot is a copy of mp_Hamt.
+ *
+ */
+
+#include "mp.h"
+
+#include <stdlib.h>
+
+#define HAMT_BITS 5
+#define HAMT_MASK ((1u << HAMT_BITS) - 1)
+#define HAMT_HASH_BITS 64 // past those, names with equal hashes share a collision node
+#define HAMT_LEAF 1 // tag of slots holding a definition
+
+static inline MP_BOOL slot_isleaf (uintptr_t slot) {
+	return (slot & HAMT_LEAF) ? MP_TRUE : MP_FALSE;
+}
+static inline struct mp_Macro* slot_leaf (uintptr_t slot) {
+	return (struct mp_Macro*)(slot & ~(uintptr_t)HAMT_LEAF);
+}
+static inline const struct mp_HamtNode* slot_node (uintptr_t slot) {
+	return (const struct mp_HamtNode*)slot;
+}
+static inline uintptr_t leaf_slot (const struct mp_Macro* macro) {
+	return (uintptr_t)macro | HAMT_LEAF;
+}
+
+// index of the slot for bit 'bit'
+static inline uint32_t node_index (const struct mp_HamtNode* node, uint32_t bit) {
+	return __builtin_popcount(node->bitmap & (bit - 1));
+}
+
+static inline MP_BOOL leaf_eq (const struct mp_Macro* macro, uint64_t hash, const char* name, size_t len) {
+	return (macro->hash == hash) && mp_cstr_eq(macro->name, macro->namelen, name, len);
+}
+
+// FNV-1a
+uint64_t mp_hamt_hash (const char* name, size_t len)
+{
+	uint64_t hash = 14695981039346656037u;
+	for (size_t i = 0; i < len; i++) {
+		hash ^= (unsigned char)name[i];
+		hash *= 1099511628211u;
+	}
+	return hash;
+}
+
+/*
+ *
+ * Find the definition named 'name' (of length 'len')
+ * returns macro/NULL
+ *
+ */
+struct mp_Macro* mp_hamt_find (const struct mp_Hamt* hamt, const char* name, size_t len)
+{
+	if (len > hamt->maxnamelen)
+		return NULL;
+	uint64_t hash = mp_hamt_hash(name, len);
+	const struct mp_HamtNode* node = hamt->root;
+	for (unsigned shift = 0; node != NULL; shift += HAMT_BITS) {
+		if (shift >= HAMT_HASH_BITS) { // collision node
+			for (uint32_t i = 0; i < node->count; i++)
+				if (leaf_eq(slot_leaf(node->slots[i]), hash, name, len) == MP_TRUE)
+					return slot_leaf(node->slots[i]);
+			return NULL;
+		}
+
+		uint32_t bit = 1u << ((hash >> shift) & HAMT_MASK);
+		if ((node->bitmap & bit) == 0)
+			return NULL;
+		uintptr_t slot = node->slots[node_index(node, bit)];
+		if (slot_isleaf(slot) == MP_TRUE) {
+			struct mp_Macro* macro = slot_leaf(slot);
+			return (leaf_eq(macro, hash, name, len) == MP_TRUE) ? macro : NULL;
+		}
+		node = slot_node(slot);
+	}
+	return NULL;
+}
+
+// returns a node with 'count' slots, added to the list of allocated nodes, or NULL if out of memory
+static struct mp_HamtNode* new_node (struct mp_HamtNode** nodes, uint32_t bitmap, uint32_t count)
+{
+	struct mp_HamtNode* node = malloc(sizeof(*node) + sizeof(*node->slots) * count);
+	if (node == NULL)
+		return NULL;
+	node->next = *nodes;
+	*nodes = node;
+	node->bitmap = bitmap;
+	node->count = count;
+	return node;
+}
+
+// copy of 'node', with slot 'i' replaced by 'slot'
+static struct mp_HamtNode* node_with (struct mp_HamtNode** nodes, const struct mp_HamtNode* node, uint32_t i, uintptr_t slot)
+{
+	struct mp_HamtNode* copy = new_node(nodes, node->bitmap, node->count);
+	if (copy == NULL)
+		return NULL;
+	memcpy(copy->slots, node->slots, sizeof(*node->slots) * node->count);
+	copy->slots[i] = slot;
+	return copy;
+}
+
+// copy of 'node', with 'slot' inserted at 'i' (for bit 'bit')
+static struct mp_HamtNode* node_insert (struct mp_HamtNode** nodes, const struct mp_HamtNode* node, uint32_t bit, uint32_t i, uintptr_t slot)
+{
+	struct mp_HamtNode* copy = new_node(nodes, node->bitmap | bit, node->count + 1);
+	if (copy == NULL)
+		return NULL;
+	memcpy(copy->slots, node->slots, sizeof(*node->slots) * i);
+	copy->slots[i] = slot;
+	memcpy(&copy->slots[i + 1], &node->slots[i], sizeof(*node->slots) * (node->count - i));
+	return copy;
+}
+
+// subtree (at 'shift') of two definitions with different names
+static struct mp_HamtNode* node_pair (struct mp_HamtNode** nodes, const struct mp_Macro* a, const struct mp_Macro* b, unsigned shift)
+{
+	if (shift >= HAMT_HASH_BITS) {
+		struct mp_HamtNode* node = new_node(nodes, 0, 2);
+		if (node == NULL)
+			return NULL;
+		node->slots[0] = leaf_slot(a);
+		node->slots[1] = leaf_slot(b);
+		return node;
+	}
+
+	uint32_t ia = (a->hash >> shift) & HAMT_MASK;
+	uint32_t ib = (b->hash >> shift) & HAMT_MASK;
+	if (ia == ib) {
+		struct mp_HamtNode* child = node_pair(nodes, a, b, shift + HAMT_BITS);
+		if (child == NULL)
+			return NULL;
+		struct mp_HamtNode* node = new_node(nodes, 1u << ia, 1);
+		if (node == NULL)
+			return NULL;
+		node->slots[0] = (uintptr_t)child;
+		return node;
+	}
+
+	struct mp_HamtNode* node = new_node(nodes, (1u << ia) | (1u << ib), 2);
+	if (node == NULL)
+		return NULL;
+	node->slots[(ia < ib) ? 0 : 1] = leaf_slot(a);
+	node->slots[(ia < ib) ? 1 : 0] = leaf_slot(b);
+	return node;
+}
+
+// copy of 'node' (at 'shift') with 'macro' set, *added set if the name is new
+static struct mp_HamtNode* node_set (struct mp_HamtNode** nodes, const struct mp_HamtNode* node, unsigned shift, const struct mp_Macro* macro, MP_BOOL* added)
+{
+	if (shift >= HAMT_HASH_BITS) { // collision node
+		for (uint32_t i = 0; i < node->count; i++)
+			if (leaf_eq(slot_leaf(node->slots[i]), macro->hash, macro->name, macro->namelen) == MP_TRUE)
+				return node_with(nodes, node, i, leaf_slot(macro));
+		*added = MP_TRUE;
+		return node_insert(nodes, node, 0, node->count, leaf_slot(macro));
+	}
+
+	uint32_t bit = 1u << ((macro->hash >> shift) & HAMT_MASK);
+	uint32_t i = node_index(node, bit);
+	if ((node->bitmap & bit) == 0) {
+		*added = MP_TRUE;
+		return node_insert(nodes, node, bit, i, leaf_slot(macro));
+	}
+
+	uintptr_t slot = node->slots[i];
+	struct mp_HamtNode* child;
+	if (slot_isleaf(slot) == MP_FALSE)
+		child = node_set(nodes, slot_node(slot), shift + HAMT_BITS, macro, added);
+	else {
+		const struct mp_Macro* old = slot_leaf(slot);
+		if (leaf_eq(old, macro->hash, macro->name, macro->namelen) == MP_TRUE)
+			return node_with(nodes, node, i, leaf_slot(macro)); // redefinition
+		*added = MP_TRUE;
+		child = node_pair(nodes, old, macro, shift + HAMT_BITS);
+	}
+	if (child == NULL)
+		return NULL;
+	return node_with(nodes, node, i, (uintptr_t)child);
+}
+
+/*
+ *
+ * Set the definition of macro's name to 'macro', previous versions of the table stay unchanged.
+ * New nodes are added to the list of allocated nodes 'nodes'.
+ * returns MP_OK/MP_BAD
+ *
+ */
+int mp_hamt_set (struct mp_Hamt* hamt, struct mp_HamtNode** nodes, struct mp_Macro* macro)
+{
+	macro->hash = mp_hamt_hash(macro->name, macro->namelen);
+
+	MP_BOOL added = MP_FALSE;
+	struct mp_HamtNode* root;
+	if (hamt->root == NULL) {
+		added = MP_TRUE;
+		root = new_node(nodes, 1u << (macro->hash & HAMT_MASK), 1);
+		if (root != NULL)
+			root->slots[0] = leaf_slot(macro);
+	}
+	else root = node_set(nodes, hamt->root, 0, macro, &added);
+
+	if (root == NULL) {
+		MP_PRINT_ERROR("Out of memory while defining macro \"%.*s\"", macro->namelen, macro->name);
+		return MP_BAD;
+	}
+	hamt->root = root;
+	if (added == MP_TRUE)
+		hamt->count++;
+	if (macro->namelen > hamt->maxnamelen)
+		hamt->maxnamelen = macro->namelen;
+	return MP_OK;
+}
+
+// free the nodes allocated after 'until' (newer nodes come first), with the versions of the tables built from them
+void mp_hamt_free_since (struct mp_HamtNode** nodes, const struct mp_HamtNode* until)
+{
+	while (*nodes != until) {
+		struct mp_HamtNode* next = (*nodes)->next;
+		free(*nodes);
+		*nodes = next;
+	}
+}
+
+// free the list of allocated nodes, with every version of the tables built from them
+void mp_hamt_free (struct mp_HamtNode** nodes)
+{
+	mp_hamt_free_since(nodes, NULL);
+}
@@ -4,44 +4,217 @@
 #include <stdlib.h>
 
 inline static void print_usage (const char* name) {
-	printf("Usage: %s <src> <out>", name);
+	printf("Usage: %s [-s] [-v <name> <defs>]... <src> <out> [<src> <out>]...", name);
+}
+
+struct mp_Stats {
+	size_t files;
+	size_t passthrough; // copied without processing
+};
+
+// named set of definitions, every source is processed once per variant
+struct mp_Variant {
+	const char* name; // if NULL, outputs aren't suffixed
+	const char* defsfn;
+	char* defs;
+	struct mp_ProcessEnv* pe;
+	char* outfn;
+};
+
+// process the variant's definitions, their output is discarded
+static int variant_init (struct mp_Variant* var)
+{
+	var->defs = NULL;
+	var->outfn = NULL;
+	var->pe = malloc(sizeof(*var->pe));
+	if (var->pe == NULL) {
+		MP_PRINT_ERROR("Out of memory");
+		return MP_BAD;
+	}
+	mp_PE_init(var->pe, NULL, NULL, 0, 0, MP_ENDCH_NONE);
+	if (var->defsfn == NULL)
+		return MP_OK;
+
+	long flen;
+	if (mp_file_read(NULL, var->defsfn, NULL, &var->defs, &flen, 0, 0, MP_TRUE) != MP_OK)
+		return MP_BAD;
+	mp_PE_set_src(var->pe, var->defs, var->defsfn, flen, 0, MP_ENDCH_NONE);
+	int ret = mp_process(var->pe);
+	mp_PE_free(var->pe);
+	return ret;
+}
+
+static void variant_free (struct mp_Variant* var)
+{
+	if (var->pe != NULL)
+		mp_PE_free_all(var->pe);
+	free(var->pe);
+	free(var->defs);
+	free(var->outfn);
+}
+
+// set var->outfn to "<outfn>.<name>"
+static int variant_outfn (struct mp_Variant* var, const char* outfn)
+{
+	free(var->outfn);
+	var->outfn = NULL;
+	if (var->name == NULL)
+		return MP_OK;
+	var->outfn = malloc(strlen(outfn) + strlen(var->name) + 2);
+	if (var->outfn == NULL) {
+		MP_PRINT_ERROR("Out of memory");
+		return MP_BAD;
+	}
+	sprintf(var->outfn, "%s.%s", outfn, var->name);
+	return MP_OK;
+}
+
+// process the source read by 'req' into 'outfn' in every variant
+// the source stays allocated in *src, definitions (and outputs passed through) point into it
+// 'pes' and 'rets' have room for 'varc' elements
+static void process_file (struct mp_Batch* batch, struct mp_VariantScan* vscan, struct mp_Variant* vars, size_t varc, struct mp_ProcessEnv** pes, int* rets, struct mp_Stats* stats, struct mp_FileReq* req, const char* outfn, char** src)
+{
+	const char* srcfn = req->filename;
+	long flen;
+	if (mp_batch_wait_read(batch, req, src, &flen) != MP_OK)
+		return;
+
+	size_t pec = 0;
+	for (size_t i = 0; i < varc; i++) {
+		struct mp_Variant* var = &vars[i];
+		if (variant_outfn(var, outfn) == MP_BAD)
+			return;
+		const char* fn = (var->outfn != NULL) ? var->outfn : outfn;
+
+		mp_PE_set_src(var->pe, *src, srcfn, flen, 0, MP_ENDCH_NONE);
+		stats->files++;
+		if (mp_PE_passthrough(var->pe) == MP_TRUE) {
+			stats->passthrough++;
+			mp_batch_copy(batch, srcfn, fn, *src, flen);
+		}
+		else pes[pec++] = var->pe;
+	}
+
+	mp_process_variants(vscan, pes, rets, pec);
+
+	for (size_t i = 0, j = 0; i < varc; i++) {
+		struct mp_Variant* var = &vars[i];
+		if (
+			(j >= pec) ||
+			(pes[j] != var->pe)
+		) continue; // passed through
+		if (rets[j++] == MP_OK)
+			mp_batch_write_rope(batch, (var->outfn != NULL) ? var->outfn : outfn, &var->pe->out);
+		mp_PE_free(var->pe);
+	}
 }
 
 int main (int argc, char* argv[])
 {
-	if (argc < 2) {
+	MP_BOOL printstats = MP_FALSE;
+	int argi = 1;
+	if (
+		(argi < argc) &&
+		(strcmp(argv[argi], "-s") == 0)
+	) {
+		printstats = MP_TRUE;
+		argi++;
+	}
+
+	int varargi = argi;
+	size_t varc = 0;
+	while (
+		(argi < argc) &&
+		(strcmp(argv[argi], "-v") == 0)
+	) {
+		if (argc - argi < 3) {
+			MP_PRINT_ERROR("Missing name or definitions of a variant");
+			print_usage(argv[0]);
+			return 0;
+		}
+		varc++;
+		argi += 3;
+	}
+
+	if (argc - argi < 1) {
 		MP_PRINT_ERROR("No source file specified");
 		print_usage(argv[0]);
 		return 0;
 	}
 
-	if (argc < 3) {
+	if (argc - argi < 2) {
 		MP_PRINT_ERROR("No output file specified");
 		print_usage(argv[0]);
 		return 0;
 	}
 
-	if (argc > 4) {
+	if ((argc - argi) % 2 != 0) {
 		MP_PRINT_ERROR("Invalid number of arguments");
 		print_usage(argv[0]);
 		return 0;
 	}
 
-	long flen;
-	char* src = NULL;
-	char* srcfn = argv[1];
-	char* outfn = argv[2];
+	// without variants, a single unnamed one
+	MP_BOOL hasvars = (varc > 0) ? MP_TRUE : MP_FALSE;
+	if (hasvars == MP_FALSE)
+		varc = 1;
+
+	// files are processed in order, definitions carry over to the following ones
+	// the sources are read ahead and the outputs written in the background, see mp_Batch
+	struct mp_Batch batch;
+	mp_batch_init(&batch, MP_IO_DEPTH);
+	struct mp_VariantScan vscan;
+	mp_vscan_init(&vscan);
+	size_t filec = (argc - argi) / 2;
+	char** srcs = calloc(filec, sizeof(*srcs));
+	struct mp_FileReq* reqs = calloc(filec, sizeof(*reqs));
+	struct mp_Variant* vars = calloc(varc, sizeof(*vars));
+	struct mp_ProcessEnv** pes = calloc(varc, sizeof(*pes));
+	int* rets = calloc(varc, sizeof(*rets));
+	if (
+		(srcs == NULL) ||
+		(reqs == NULL) ||
+		(vars == NULL) ||
+		(pes == NULL) ||
+		(rets == NULL)
+	) {
+		MP_PRINT_ERROR("Out of memory");
+		goto cleanup;
+	}
+
+	for (size_t i = 0; i < varc; i++) {
+		if (hasvars == MP_TRUE) {
+			vars[i].name = argv[varargi + 3 * i + 1];
+			vars[i].defsfn = argv[varargi + 3 * i + 2];
+		}
+		if (variant_init(&vars[i]) == MP_BAD)
+			goto cleanup;
+	}
 
-	if (mp_file_read(NULL, srcfn, NULL, &src, &flen, 0, 0, MP_TRUE) == MP_OK) {
-		char* out = malloc(sizeof(*out) * (flen + 1));
-		struct mp_ProcessEnv pe;
-		mp_PE_init(&pe, src, srcfn, out, flen, 0, MP_ENDCH_NONE);
-		if (mp_process(&pe) == MP_OK)
-			mp_file_write(NULL, outfn, pe.ctx.outBuff, pe.state.outofs);
-		mp_PE_free(&pe);
-		free(out);
+	struct mp_Stats stats = { 0, 0 };
+	size_t readc = 0;
+	for (size_t i = 0; i < filec; i++) {
+		for (; (readc < filec) && (readc <= i + MP_IO_PREFETCH); readc++)
+			mp_batch_read(&batch, &reqs[readc], argv[argi + 2 * readc]);
+		process_file(&batch, &vscan, vars, varc, pes, rets, &stats, &reqs[i], argv[argi + 2 * i + 1], &srcs[i]);
 	}
 
-	free(src);
+	if (printstats == MP_TRUE)
+		printf("Files: %zu, passed through: %zu\n", stats.files, stats.passthrough);
+
+cleanup:
+	mp_batch_free(&batch);
+	mp_vscan_free(&vscan);
+	if (vars != NULL)
+		for (size_t i = 0; i < varc; i++)
+			variant_free(&vars[i]);
+	if (srcs != NULL)
+		for (size_t i = 0; i < filec; i++)
+			free(srcs[i]);
+	free(srcs);
+	free(reqs);
+	free(vars);
+	free(pes);
+	free(rets);
 	return 0;
 }
\ No newline at end of file
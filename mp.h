@@ -28,15 +28,156 @@
 #define MP_PRINT_WARNING(frmt, ...)			  (printf(("Warning: " frmt "\n") __VA_OPT__(,) __VA_ARGS__))
 #define MP_PRINT_PROCESS_ERROR(pe, frmt, ...) (MP_PRINT_ERROR(frmt " at offset %u (ln:%u col:%u), while processing file \"%s\"" __VA_OPT__(,) __VA_ARGS__, (pe)->state.srcofs + 1, (pe)->state.ln, (pe)->state.srcofs - (pe)->state.lnsidx + 1, (pe)->fn))
 
-// file
-int mp_file_read  (FILE* f, const char* filename, char* buff, char** optBuff, long* flenPtr, long offset, size_t readlen, MP_BOOL nullterm);
-int mp_file_write (FILE* f, const char* filename, const char* buff, size_t len);
-
 struct mp_String {
 	char* buff;
 	size_t len;
 };
 
+/*
+ *
+ * rope
+ *
+ */
+
+struct mp_Rope;
+
+struct mp_Span {
+	const char* str; // if NULL, the span refers to 'rope'
+	size_t len;
+	const struct mp_Rope* rope;
+};
+
+struct mp_Rope {
+	struct mp_Span* spans;
+	size_t spanc;
+	size_t spancap;
+	size_t len; // flattened length
+	struct mp_Rope* next; // next allocated rope, see mp_ProcessEnv
+};
+
+void   mp_rope_init        (struct mp_Rope* rope);
+void   mp_rope_free        (struct mp_Rope* rope);
+int    mp_rope_append_str  (struct mp_Rope* rope, const char* str, size_t len);
+int    mp_rope_append_rope (struct mp_Rope* rope, const struct mp_Rope* child);
+size_t mp_rope_flatten     (const struct mp_Rope* rope, char* buff);
+
+/*
+ *
+ * scanner
+ *
+ */
+
+#define MP_SCAN_SYMS 65 // non-word character, word characters, MP_INSTRUCTION_PREFIX
+
+struct mp_Scanner {
+	uint32_t* next; // transitions, MP_SCAN_SYMS per state
+	uint32_t* namelen; // length of the name matched in each state, 0 if none
+	size_t statec;
+	size_t statecap;
+	size_t defc; // scanned definitions, see mp_ProcessEnv
+};
+
+int    mp_scanner_init (struct mp_Scanner* sc);
+void   mp_scanner_free (struct mp_Scanner* sc);
+int    mp_scanner_add  (struct mp_Scanner* sc, const char* name, size_t len);
+size_t mp_scanner_next (const struct mp_Scanner* sc, const char* src, size_t len, size_t ofs);
+
+/*
+ *
+ * file
+ *
+ */
+
+int mp_file_read       (FILE* f, const char* filename, char* buff, char** optBuff, long* flenPtr, long offset, size_t readlen, MP_BOOL nullterm);
+int mp_file_write      (FILE* f, const char* filename, const char* buff, size_t len);
+int mp_file_write_rope (FILE* f, const char* filename, const struct mp_Rope* rope);
+int mp_file_copy       (const char* srcfn, const char* outfn, const char* buff, size_t len);
+
+#if defined(__linux__) && defined(__has_include)
+	#if __has_include(<linux/io_uring.h>)
+		#define MP_HAVE_URING
+	#endif
+#endif
+
+// io_uring, see uring.c
+struct mp_Ring;
+#ifdef MP_HAVE_URING
+struct mp_Ring* mp_ring_new    (unsigned entries);
+void            mp_ring_free   (struct mp_Ring* ring);
+int             mp_ring_read   (struct mp_Ring* ring, int fd, void* buff, unsigned len, uint64_t offset, uint64_t tag);
+int             mp_ring_write  (struct mp_Ring* ring, int fd, const void* buff, unsigned len, uint64_t offset, uint64_t tag);
+int             mp_ring_submit (struct mp_Ring* ring, unsigned waitnr);
+MP_BOOL         mp_ring_reap   (struct mp_Ring* ring, uint64_t* tag, int* res);
+#endif
+
+enum mp_FileReqState {
+	MP_REQ_IDLE, // left to the buffered path
+	MP_REQ_PENDING,
+	MP_REQ_DONE,
+	MP_REQ_FAILED
+};
+
+// file read or written through mp_Batch
+struct mp_FileReq {
+	const char* filename;
+	int fd;
+	char* buff;
+	size_t len;
+	size_t done; // transferred bytes
+	int state;
+	MP_BOOL iswrite;
+	MP_BOOL ownsbuff; // writes: free 'buff' once written
+	MP_BOOL stale; // reads: overwritten by an output since
+	uint64_t dev; // reads: identity of the file
+	uint64_t ino;
+	struct mp_FileReq* next; // see mp_Batch
+};
+
+// reads started ahead of time and writes completed in the background
+struct mp_Batch {
+	struct mp_Ring* ring; // if NULL, requests go through the buffered path right away
+	size_t depth; // max. requests in flight
+	size_t inflight;
+	struct mp_FileReq* reads; // started, not waited for yet
+	struct mp_FileReq* writes; // in flight
+};
+
+void mp_batch_init       (struct mp_Batch* batch, unsigned depth);
+void mp_batch_free       (struct mp_Batch* batch);
+void mp_batch_read       (struct mp_Batch* batch, struct mp_FileReq* req, const char* filename);
+int  mp_batch_wait_read  (struct mp_Batch* batch, struct mp_FileReq* req, char** buff, long* flen);
+int  mp_batch_write_rope (struct mp_Batch* batch, const char* filename, const struct mp_Rope* rope);
+int  mp_batch_copy       (struct mp_Batch* batch, const char* srcfn, const char* outfn, const char* buff, size_t len);
+int  mp_batch_flush      (struct mp_Batch* batch);
+
+/*
+ *
+ * hamt
+ *
+ */
+
+struct mp_Macro;
+
+struct mp_HamtNode {
+	struct mp_HamtNode* next; // next allocated node, see mp_ProcessEnv
+	uint32_t bitmap; // occupied slots, see hamt.c
+	uint32_t count;
+	uintptr_t slots[]; // child nodes, or definitions
+};
+
+// version of the table of definitions, see mp_PE_snapshot
+struct mp_Hamt {
+	const struct mp_HamtNode* root; // NULL if empty
+	size_t count;
+	size_t maxnamelen; // longer words aren't hashed
+};
+
+uint64_t         mp_hamt_hash (const char* name, size_t len);
+struct mp_Macro* mp_hamt_find (const struct mp_Hamt* hamt, const char* name, size_t len);
+int              mp_hamt_set  (struct mp_Hamt* hamt, struct mp_HamtNode** nodes, struct mp_Macro* macro);
+void             mp_hamt_free_since (struct mp_HamtNode** nodes, const struct mp_HamtNode* until);
+void             mp_hamt_free (struct mp_HamtNode** nodes);
+
 /*
  *
  * process
@@ -48,36 +189,79 @@ enum mp_DelimWhat {
 	MP_DELIM_PARAMS
 };
 
+// line endings of a source, see process.c
+enum mp_NewLines {
+	MP_NL_LF, // "\n" only
+	MP_NL_CRLF, // "\r\n" only
+	MP_NL_MIXED // anything, "\r" included
+};
+
 struct mp_Macro {
 	const char* name;
 	size_t namelen;
-	char* def;
+	uint64_t hash; // of 'name', definitions only
+	const char* def;
 	size_t deflen;
+	int nl; // line endings of 'def'
 	MP_BOOL isfunc;
 	struct mp_String* params;
 	size_t paramc;
 	MP_BOOL exp; // expanded?
+	const struct mp_Rope* rope; // if not NULL, already expanded definition (arguments)
+	MP_BOOL isarg;
+	size_t argbase; // arguments: scope 'def' is processed in, see mp_ProcessState
+	size_t argtop;
+	// forwarding, e.g. "#define B(c,d) A(d,c)" or "#define Y X"
+	const char* fwdname; // if not NULL, the definition only forwards to macro 'fwdname'
+	size_t fwdnamelen;
+	size_t* fwdargs; // forwarded parameters (indices into 'params')
+	size_t fwdargc;
+	struct mp_Macro* fwd; // final target of the chain, resolved at 'fwdgen'
+	size_t* fwdmap; // maps fwd's parameters to own parameters
+	size_t fwdgen;
 };
 
 struct mp_ProcessState {
 	size_t srcofs;
-	size_t outofs;
 	MP_BOOL eof;
 	size_t ln;
 	size_t lnsidx; // line start index
 	MP_BOOL isinstr;
-	size_t nllen;
-	const char* nlstr;
 	const char* word;
 	size_t wlen;
+	const struct mp_Rope* rope; // expansion result
 	const char* writestart;
+	size_t argbase; // visible arguments are pe->macros[argbase .. argtop)
+	size_t argtop;
 };
 
 struct mp_ProcessContext {
 	const char* src;
-	char* outBuff;
+	struct mp_Rope* out;
 	size_t readlen;
 	int endch;
+	int nl; // line endings of 'src'
+	MP_BOOL istop; // processing the source, not an expansion
+};
+
+// position in the source where processing could do something other than copy
+struct mp_Candidate {
+	size_t ofs;
+	size_t ln;
+	size_t lnsidx;
+};
+
+struct mp_Candidates {
+	struct mp_Candidate* cands; // ends with one at the source's length
+	size_t candc;
+	size_t candcap;
+};
+
+// scan shared by the environments of mp_process_variants(), kept from one source to the next
+struct mp_VariantScan {
+	MP_BOOL usescanner;
+	struct mp_Scanner scanner; // names defined in any of the environments, or their sources
+	struct mp_Candidates cands; // of the current source
 };
 
 struct mp_ProcessEnv {
@@ -85,18 +269,48 @@ struct mp_ProcessEnv {
 	struct mp_ProcessState state;
 	struct mp_ProcessContext ctx;
 	size_t macrostop;
-	struct mp_Macro macros[MP_MAX_MACROS];
+	struct mp_Macro macros[MP_MAX_MACROS]; // definitions, and arguments popped after each expansion
+	struct mp_Hamt defs; // visible definitions, by name
+	struct mp_HamtNode* hamtnodes; // allocated nodes of 'defs' and its earlier versions
 	size_t stringstop;
 	struct mp_String strings[MP_MAX_MACROS];
-	size_t tofreetop;
-	char* tofree[MP_MAX_MACRO_EXPS];
+	size_t defgen; // incremented with every definition
+	size_t fwdargstop;
+	size_t fwdargs[MP_MAX_MACROS];
+	size_t fwdmapstop;
+	size_t fwdmapgen;
+	size_t fwdmaps[MP_MAX_MACROS];
+	struct mp_Rope out;
+	struct mp_Rope* ropes; // allocated expansion results
+	MP_BOOL usescanner;
+	struct mp_Scanner scanner; // names of macros[0 .. scanner.defc)
+	const struct mp_Candidates* cands; // if not NULL, used instead of the scanner, see mp_process_variants
+	size_t candi;
+	size_t vscandefc; // macros[0 .. vscandefc) added to mp_VariantScan's scanner
+};
+
+// definitions of an environment to go back to, see mp_PE_snapshot
+struct mp_Snapshot {
+	struct mp_Hamt defs;
+	struct mp_HamtNode* hamtnodes;
+	size_t macrostop;
+	size_t stringstop;
+	size_t fwdargstop;
 };
 
 #define MP_ENDCH_NONE SCHAR_MIN - 1
 #define MP_ENDCH_NL   SCHAR_MIN - 2
-void mp_PE_init (struct mp_ProcessEnv* pe, const char* src, const char* fn, char* outBuff, size_t outBuffLen, size_t readlen, int endch);
+void mp_PE_init (struct mp_ProcessEnv* pe, const char* src, const char* fn, size_t srclen, size_t readlen, int endch);
+void mp_PE_set_src (struct mp_ProcessEnv* pe, const char* src, const char* fn, size_t srclen, size_t readlen, int endch);
 void mp_PE_free (struct mp_ProcessEnv* pe);
+void mp_PE_free_all (struct mp_ProcessEnv* pe);
+struct mp_Snapshot mp_PE_snapshot (const struct mp_ProcessEnv* pe);
+void mp_PE_restore (struct mp_ProcessEnv* pe, const struct mp_Snapshot* snap);
+MP_BOOL mp_PE_passthrough (struct mp_ProcessEnv* pe);
 int mp_process (struct mp_ProcessEnv* pe);
+void mp_vscan_init (struct mp_VariantScan* vscan);
+void mp_vscan_free (struct mp_VariantScan* vscan);
+void mp_process_variants (struct mp_VariantScan* vscan, struct mp_ProcessEnv* pes[], int rets[], size_t n);
 
 // cstr
 MP_BOOL mp_cstr_eq (const char* str1, size_t len1, const char* str2, size_t len2);
@@ -11,8 +11,9 @@
 #include <ctype.h>
 #include <string.h>
 
-static int process (struct mp_ProcessEnv* pe, MP_BOOL writeNL, MP_BOOL ismain);
+static int process (struct mp_ProcessEnv* pe);
 static char PE_advance (struct mp_ProcessEnv* pe);
+static int detect_newlines (const char* src, size_t len);
 static int PE_next_delim (struct mp_ProcessEnv* pe, enum mp_DelimWhat what);
 
 /*
@@ -27,52 +28,138 @@ static void PE_reset_state (struct mp_ProcessEnv* pe)
 	pe->state.ln = 1;
 	pe->state.lnsidx = 0;
 	pe->state.srcofs = 0;
-	pe->state.outofs = 0;
-	pe->state.nllen = 0;
-	pe->state.eof = MP_FALSE;
+	pe->state.eof = (pe->ctx.readlen == 0) ? MP_TRUE : MP_FALSE;
 	pe->state.isinstr = MP_FALSE;
 	pe->state.writestart = NULL;
-	pe->state.nlstr = NULL;
+	pe->state.rope = NULL;
+	pe->state.argbase = 0;
+	pe->state.argtop = 0;
 }
 
 void mp_PE_init (
 	struct mp_ProcessEnv* pe,
 	const char* src,
 	const char* fn,				// if NULL, set to "UNNAMED"
-	char* outBuff,
-	size_t outBuffLen,
-	size_t readlen,				// if 0 or higher than outBuffLen, set to outBuffLen
+	size_t srclen,
+	size_t readlen,				// if 0 or higher than srclen, set to srclen
+	int endch
+) {
+	pe->macrostop = 0;
+	pe->defs.root = NULL;
+	pe->defs.count = 0;
+	pe->defs.maxnamelen = 0;
+	pe->hamtnodes = NULL;
+	pe->stringstop = 0;
+	pe->defgen = 1;
+	pe->fwdargstop = 0;
+	pe->fwdmapstop = 0;
+	pe->fwdmapgen = 0;
+	pe->ropes = NULL;
+	pe->usescanner = (mp_scanner_init(&pe->scanner) == MP_OK) ? MP_TRUE : MP_FALSE;
+	pe->vscandefc = 0;
+
+	mp_rope_init(&pe->out);
+	mp_PE_set_src(pe, src, fn, srclen, readlen, endch);
+}
+
+// switch to another source, keeping the definitions
+// output of the previous one has to be freed with mp_PE_free
+void mp_PE_set_src (
+	struct mp_ProcessEnv* pe,
+	const char* src,
+	const char* fn,				// if NULL, set to "UNNAMED"
+	size_t srclen,
+	size_t readlen,				// if 0 or higher than srclen, set to srclen
 	int endch
 ) {
 	if (fn == NULL)
 		fn = "UNNAMED";
 
-	pe->macrostop = 0;
-	pe->stringstop = 0;
-	pe->tofreetop = 0;
 	pe->fn = fn;
-
 	pe->ctx.src = src;
-	pe->ctx.outBuff = outBuff;
+	pe->ctx.out = &pe->out;
 	pe->ctx.endch = endch;
+	pe->ctx.istop = MP_TRUE;
+	pe->cands = NULL;
+	pe->candi = 0;
 
-	PE_reset_state(pe);
-
-	if (readlen > outBuffLen)
-		MP_PRINT_WARNING("'readlen' (%zu) exceeds 'outlen' (%zu) for '%s'", readlen, outBuffLen, fn);
+	if (readlen > srclen)
+		MP_PRINT_WARNING("'readlen' (%zu) exceeds 'srclen' (%zu) for '%s'", readlen, srclen, fn);
 	if (
 		(readlen == 0) ||
-		(readlen > outBuffLen)
+		(readlen > srclen)
 	)
-		 pe->ctx.readlen = outBuffLen;
+		 pe->ctx.readlen = srclen;
 	else pe->ctx.readlen = readlen;
+	pe->ctx.nl = detect_newlines(src, pe->ctx.readlen);
+
+	PE_reset_state(pe);
 }
 
-// free pe->tofree
+// free the output and all expansion results
 void mp_PE_free (struct mp_ProcessEnv* pe)
 {
-	while (pe->tofreetop > 0)
-		free(pe->tofree[--pe->tofreetop]);
+	while (pe->ropes != NULL) {
+		struct mp_Rope* next = pe->ropes->next;
+		mp_rope_free(pe->ropes);
+		free(pe->ropes);
+		pe->ropes = next;
+	}
+	mp_rope_free(&pe->out);
+}
+
+// free everything, including the definitions' table and scanner
+void mp_PE_free_all (struct mp_ProcessEnv* pe)
+{
+	mp_PE_free(pe);
+	mp_hamt_free(&pe->hamtnodes);
+	pe->defs.root = NULL;
+	pe->defs.count = 0;
+	pe->defs.maxnamelen = 0;
+	mp_scanner_free(&pe->scanner);
+	pe->usescanner = MP_FALSE;
+}
+
+/*
+ *
+ * Snapshot of the definitions, O(1), to roll the same environment back to with mp_PE_restore().
+ * The table is persistent, but the definitions it points to also cache how their forwarding chains
+ * resolve in this environment (see PE_resolve_fwd), so a snapshot can't be shared with another one.
+ * Stays valid until an earlier snapshot is restored, or mp_PE_free_all().
+ *
+ */
+struct mp_Snapshot mp_PE_snapshot (const struct mp_ProcessEnv* pe)
+{
+	struct mp_Snapshot snap;
+	snap.defs = pe->defs;
+	snap.hamtnodes = pe->hamtnodes;
+	snap.macrostop = pe->macrostop;
+	snap.stringstop = pe->stringstop;
+	snap.fwdargstop = pe->fwdargstop;
+	return snap;
+}
+
+/*
+ *
+ * Go back to the definitions of a snapshot
+ * Definitions made since are dropped, freeing their slots and table nodes.
+ *
+ */
+void mp_PE_restore (struct mp_ProcessEnv* pe, const struct mp_Snapshot* snap)
+{
+	if (pe->defs.root != snap->defs.root)
+		pe->defgen++; // forwarding chains may resolve differently
+	pe->defs = snap->defs;
+	mp_hamt_free_since(&pe->hamtnodes, snap->hamtnodes);
+	pe->macrostop = snap->macrostop;
+	pe->stringstop = snap->stringstop;
+	pe->fwdargstop = snap->fwdargstop;
+
+	// names of dropped definitions stay in the scanners, as extra candidates
+	if (pe->scanner.defc > pe->macrostop)
+		pe->scanner.defc = pe->macrostop;
+	if (pe->vscandefc > pe->macrostop)
+		pe->vscandefc = pe->macrostop;
 }
 
 /*
@@ -88,7 +175,7 @@ static inline const char* PE_advCharPtr (struct mp_ProcessEnv* pe) {
 	return &pe->ctx.src[++pe->state.srcofs];
 }
 static inline char PE_char (struct mp_ProcessEnv* pe) {
-	return * PE_charPtr(pe);
+	return pe->state.eof ? '\0' : * PE_charPtr(pe);
 }
 static inline char PE_advChar (struct mp_ProcessEnv* pe) {
 	return * PE_advCharPtr(pe);
@@ -98,14 +185,14 @@ static inline char PE_advChar (struct mp_ProcessEnv* pe) {
 static MP_BOOL is_wordbegc (char c) {
 	return (
 		(c == '_') ||
-		isalpha(c)
+		isalpha((unsigned char)c)
 	) ? MP_TRUE : MP_FALSE;
 }
 // is word char (not beggining)
 static MP_BOOL is_wordc (char c) {
 	return (
 		(c == '_') ||
-		isalnum(c)
+		isalnum((unsigned char)c)
 	) ? MP_TRUE : MP_FALSE;
 }
 // is a horizontal whitespace
@@ -117,6 +204,71 @@ static MP_BOOL is_Hws (char c) {
 		(c == '\f')
 	) ? MP_TRUE : MP_FALSE;
 }
+/*
+ *
+ * Line endings of src[0 .. len)
+ * Lines end with '\n' or '\r', "\r\n" counts as one (at '\r').
+ * Knowing which of them occur lets the loops below look for a single character,
+ * the general loops handle anything.
+ *
+ */
+static int detect_newlines (const char* src, size_t len)
+{
+	if (len == 0)
+		return MP_NL_LF;
+	const char* end = src + len;
+	const char* cr = memchr(src, '\r', len);
+	if (cr == NULL)
+		return MP_NL_LF;
+	for (; cr != NULL; cr = memchr(cr + 1, '\r', end - cr - 1))
+		if (
+			(cr + 1 >= end) ||
+			(cr[1] != '\n')
+		) return MP_NL_MIXED;
+	for (const char* lf = memchr(src, '\n', len); lf != NULL; lf = memchr(lf + 1, '\n', end - lf - 1))
+		if (
+			(lf == src) ||
+			(lf[-1] != '\r')
+		) return MP_NL_MIXED;
+	return MP_NL_CRLF;
+}
+
+// count the new lines in src[from .. to), updating *ln and *lnsidx (line start index)
+static void count_lines (const char* src, size_t from, size_t to, int nl, size_t* ln, size_t* lnsidx)
+{
+	if (from >= to)
+		return;
+	const char* end = &src[to];
+	if (nl == MP_NL_LF) {
+		for (const char* lf = memchr(&src[from], '\n', to - from); lf != NULL; lf = memchr(lf + 1, '\n', end - lf - 1)) {
+			(*ln)++;
+			*lnsidx = lf - src + 1;
+		}
+	}
+	else if (nl == MP_NL_CRLF) {
+		if (src[from] == '\n') // rest of "\r\n"
+			*lnsidx = from + 1;
+		for (const char* cr = memchr(&src[from], '\r', to - from); cr != NULL; cr = memchr(cr + 1, '\r', end - cr - 1)) {
+			(*ln)++;
+			*lnsidx = cr - src + ((cr + 1 < end) ? 2 : 1); // past '\n', if in range
+		}
+	}
+	else for (size_t i = from; i < to; i++) {
+		char c = src[i];
+		if (
+			(c == '\n') ||
+			(c == '\r')
+		) {
+			*lnsidx = i + 1;
+			if (
+				(c == '\r') ||
+				(i == 0) ||
+				(src[i - 1] != '\r') // "\r\n" counted at '\r'
+			) (*ln)++;
+		}
+	}
+}
+
 // skip horizontal whitespace
 static void PE_skip_Hws (struct mp_ProcessEnv* pe)
 {
@@ -126,8 +278,98 @@ static void PE_skip_Hws (struct mp_ProcessEnv* pe)
 	) PE_advance(pe);
 }
 
+// move to src[ofs] without processing anything in between
+// accounts for EOF and new lines
+static void PE_jump (struct mp_ProcessEnv* pe, size_t ofs)
+{
+	if (ofs >= pe->ctx.readlen) {
+		ofs = pe->ctx.readlen;
+		pe->state.eof = MP_TRUE;
+	}
+	size_t end = pe->state.eof ? ofs : ofs + 1; // new line at src[ofs] counted as well
+	count_lines(pe->ctx.src, pe->state.srcofs + 1, end, pe->ctx.nl, &pe->state.ln, &pe->state.lnsidx);
+	pe->state.srcofs = ofs;
+}
+
+// advance to the next character that could begin a word or an instruction
+static void PE_skip_other (struct mp_ProcessEnv* pe)
+{
+	if (
+		(pe->ctx.endch != MP_ENDCH_NONE) ||
+		(pe->ctx.nl == MP_NL_MIXED)
+	) {
+		char c;
+		do c = PE_advance(pe);
+		while (
+			(!pe->state.eof) &&
+			(c != MP_INSTRUCTION_PREFIX) &&
+			(!is_wordbegc(c))
+		);
+		return;
+	}
+
+	// only one new line character to look for
+	const char* src = pe->ctx.src;
+	size_t len = pe->ctx.readlen;
+	char nlc = (pe->ctx.nl == MP_NL_LF) ? '\n' : '\r';
+	size_t nlskip = (pe->ctx.nl == MP_NL_LF) ? 1 : 2; // line starts past "\r\n"
+	size_t i = pe->state.srcofs + 1;
+	if (
+		(nlc == '\r') &&
+		(i < len) &&
+		(src[i] == '\n')
+	) pe->state.lnsidx = i + 1; // rest of "\r\n", counted at '\r'
+	for (; i < len; i++) {
+		char c = src[i];
+		if (c == nlc) {
+			pe->state.ln++;
+			pe->state.lnsidx = i + nlskip;
+		}
+		else if (
+			(c == MP_INSTRUCTION_PREFIX) ||
+			(is_wordbegc(c))
+		) break;
+	}
+	if (i >= len) {
+		i = len;
+		pe->state.eof = MP_TRUE;
+	}
+	pe->state.srcofs = i;
+}
+
 static void PE_skip_line (struct mp_ProcessEnv* pe)
 {
+	char c = PE_char(pe);
+	if (
+		(c == '\n') ||
+		(c == '\r')
+	) return; // already at the line's end, counted when reached
+
+	if (
+		(pe->ctx.endch == MP_ENDCH_NONE) &&
+		(pe->ctx.nl != MP_NL_MIXED) &&
+		(!pe->state.eof)
+	) { // the line ends at the first new line character
+		const char* src = pe->ctx.src;
+		size_t from = pe->state.srcofs + 1;
+		const char* nl = NULL;
+		if (from < pe->ctx.readlen)
+			nl = memchr(&src[from], (pe->ctx.nl == MP_NL_LF) ? '\n' : '\r', pe->ctx.readlen - from);
+		if (nl == NULL) {
+			pe->state.srcofs = pe->ctx.readlen;
+			pe->state.eof = MP_TRUE;
+			return;
+		}
+		pe->state.srcofs = nl - src;
+		pe->state.lnsidx = pe->state.srcofs + 1;
+		if (
+			(pe->ctx.nl == MP_NL_CRLF) &&
+			(pe->state.lnsidx < pe->ctx.readlen)
+		) pe->state.lnsidx++; // past "\r\n"
+		pe->state.ln++;
+		return;
+	}
+
 	size_t ln = pe->state.ln;
 	while (
 		(!pe->state.eof) &&
@@ -141,29 +383,27 @@ static void PE_skip_line (struct mp_ProcessEnv* pe)
  * 
  */
 
-static void PE_writestr (struct mp_ProcessEnv* pe, const char* str, size_t len)
+// returns MP_OK/MP_BAD
+static inline int PE_writestr (struct mp_ProcessEnv* pe, const char* str, size_t len)
 {
-	strncpy(&pe->ctx.outBuff[pe->state.outofs], str, len);
-	pe->state.outofs += len;
+	return mp_rope_append_str(pe->ctx.out, str, len);
 }
 
-// write from pe->writestart to now
-static void PE_writeall (struct mp_ProcessEnv* pe)
+// returns MP_OK/MP_BAD
+static inline int PE_writerope (struct mp_ProcessEnv* pe, const struct mp_Rope* rope)
 {
-	if (pe->state.writestart == NULL)
-		return;
-	if (PE_charPtr(pe) == pe->state.writestart) {
-		pe->state.writestart = NULL;
-		return;
-	}
-	PE_writestr(pe, pe->state.writestart, PE_charPtr(pe) - pe->state.writestart /* - pe->state.nllen*/);
-	pe->state.writestart = NULL;
+	return mp_rope_append_rope(pe->ctx.out, rope);
 }
 
-// write latest new-line
-static inline void PE_writenl (struct mp_ProcessEnv* pe)
+// write from pe->writestart to now
+// returns MP_OK/MP_BAD
+static int PE_writeall (struct mp_ProcessEnv* pe)
 {
-	PE_writestr(pe, pe->state.nlstr, pe->state.nllen);
+	if (pe->state.writestart == NULL)
+		return MP_OK;
+	const char* start = pe->state.writestart;
+	pe->state.writestart = NULL;
+	return PE_writestr(pe, start, PE_charPtr(pe) - start);
 }
 
 /*
@@ -185,53 +425,61 @@ static int PE_word (struct mp_ProcessEnv* pe)
 		ret = MP_BAD;
 	}
 
+	// word characters can't be new lines, nor (usually) the end character, skip to the last one
+	if (
+		(is_wordc(c)) &&
+		(
+			(pe->ctx.endch < SCHAR_MIN) ||
+			(!is_wordc(pe->ctx.endch))
+		)
+	) {
+		const char* src = pe->ctx.src;
+		size_t i = pe->state.srcofs;
+		while (
+			(i + 1 < pe->ctx.readlen) &&
+			(is_wordc(src[i + 1]))
+		) i++;
+		pe->state.srcofs = i;
+	}
+
 	while (is_wordc(c))
 		c = PE_advance(pe);
-	pe->state.wlen = PE_charPtr(pe) - pe->state.word - pe->state.nllen;
+	pe->state.wlen = PE_charPtr(pe) - pe->state.word;
 
 	return ret;
 }
 
 // advance to the next character
-// accounts for EOF and new lines
+// accounts for EOF and new lines, which are left in place for the caller to write
 // returns the next character, or '\0' in case of EOF
 static char PE_advance (struct mp_ProcessEnv* pe)
 {
-	if (pe->state.srcofs >= pe->ctx.readlen) {
+	if (pe->state.eof)
+		return '\0';
+	if (pe->state.srcofs + 1 >= pe->ctx.readlen) {
+		pe->state.srcofs = pe->ctx.readlen;
 		pe->state.eof = MP_TRUE;
 		return '\0';
 	}
 
-	pe->state.nllen = 0;
 	char c = PE_advChar(pe);
 
 	if (c == pe->ctx.endch)
 		pe->state.eof = MP_TRUE;
 
-	if (c == '\n') {
-		pe->state.nlstr = "\n";
-		pe->state.ln++;
-		pe->state.nllen = 1;
-		pe->state.lnsidx = pe->state.srcofs;
-		if (pe->ctx.endch == MP_ENDCH_NL)
-			pe->state.eof = MP_TRUE;
-		return c;
-	}
-	if (c == '\r') {
-		pe->state.ln++;
-		if (PE_advChar(pe) == '\n') {
-			pe->state.nlstr = "\r\n";
-			pe->state.nllen = 2;
-			PE_advCharPtr(pe);
-		}
-		else {
-			pe->state.nlstr = "\r";
-			pe->state.nllen = 1;
+	if (
+		(c == '\n') ||
+		(c == '\r')
+	) {
+		pe->state.lnsidx = pe->state.srcofs + 1;
+		if (
+			(c == '\r') ||
+			(pe->ctx.src[pe->state.srcofs - 1] != '\r') // "\r\n" counted at '\r'
+		) {
+			pe->state.ln++;
+			if (pe->ctx.endch == MP_ENDCH_NL)
+				pe->state.eof = MP_TRUE;
 		}
-		pe->state.lnsidx = pe->state.srcofs;
-		if (pe->ctx.endch == MP_ENDCH_NL)
-			pe->state.eof = MP_TRUE;
-		return c;
 	}
 
 	return c;
@@ -256,108 +504,337 @@ static struct mp_Macro* PE_next_macro (struct mp_ProcessEnv* pe)
 	macro->isfunc = MP_FALSE;
 	macro->def = NULL;
 	macro->deflen = 0;
+	macro->nl = MP_NL_MIXED;
 	macro->name = NULL;
 	macro->namelen = 0;
+	macro->hash = 0;
 	macro->params = NULL;
 	macro->paramc = 0;
+	macro->rope = NULL;
+	macro->isarg = MP_FALSE;
+	macro->argbase = 0;
+	macro->argtop = 0;
+	macro->fwdname = NULL;
+	macro->fwdnamelen = 0;
+	macro->fwdargs = NULL;
+	macro->fwdargc = 0;
+	macro->fwd = NULL;
+	macro->fwdmap = NULL;
+	macro->fwdgen = 0;
 
 	return macro;
 }
 
+// find a definition, latest one wins
+static struct mp_Macro* PE_find_def (struct mp_ProcessEnv* pe, const char* name, size_t len)
+{
+	return mp_hamt_find(&pe->defs, name, len);
+}
+
+// find a visible argument, or a definition
 static struct mp_Macro* PE_find_macro (struct mp_ProcessEnv* pe, const char* name, size_t len)
 {
-	for (size_t i = 0; i < pe->macrostop; i++)
+	for (size_t i = pe->state.argtop; i-- > pe->state.argbase;)
 	{
 		struct mp_Macro* macro = &pe->macros[i];
 		if (mp_cstr_eq(name, len, macro->name, macro->namelen) == MP_TRUE)
 			return macro;
 	}
-	return NULL;
+	return PE_find_def(pe, name, len);
 }
 
-// expand macro
-// store result in pe->state.word, pe->state.wlen
-// returns MP_OK/MP_BAD
-static int PE_expand_macro (struct mp_ProcessEnv* pe, struct mp_Macro* macro)
+/*
+ *
+ * PE :: Forwarding macros
+ *
+ * A definition which only invokes another function-like macro with its own parameters,
+ * or only names another macro, is resolved straight to the end of the chain,
+ * instead of being processed link by link.
+ *
+ */
+
+// index of the parameter named 'name', or macro->paramc if none
+static size_t macro_param_index (struct mp_Macro* macro, const char* name, size_t len)
 {
-	if (macro == NULL)
-		return MP_OK;
+	for (size_t i = macro->paramc; i-- > 0;) // latest one wins, see PE_find_macro
+		if (mp_cstr_eq(name, len, macro->params[i].buff, macro->params[i].len) == MP_TRUE)
+			return i;
+	return macro->paramc;
+}
 
-	pe->state.word = NULL;
-	pe->state.wlen = 0;
+// length of the word at the beggining of 'str' (of length 'len')
+static size_t cstr_wordlen (const char* str, size_t len)
+{
+	if (
+		(len == 0) ||
+		(!is_wordbegc(str[0]))
+	) return 0;
+	size_t i = 1;
+	while (
+		(i < len) &&
+		(is_wordc(str[i]))
+	) i++;
+	return i;
+}
 
-	if (PE_char(pe) == '(') {
-		PE_advance(pe);
+static size_t cstr_skip_Hws (const char* str, size_t len, size_t i)
+{
+	while (
+		(i < len) &&
+		(is_Hws(str[i]))
+	) i++;
+	return i;
+}
 
-		size_t argc = 0;
-		size_t oldmacrostop = pe->macrostop;
+// check whether the just defined macro only forwards, set macro->fwd* accordingly
+static void PE_analyze_fwd (struct mp_ProcessEnv* pe, struct mp_Macro* macro)
+{
+	const char* def = macro->def;
+	size_t len = macro->deflen;
 
-		// turn arguments into macros, calculate argc
-		for (size_t i = 0;; i++) {
-			int ret = PE_next_delim(pe, MP_DELIM_ARGS);
-			if (ret == MP_BAD)
-				return MP_BAD;
+	size_t namelen = cstr_wordlen(def, len);
+	if (namelen == 0)
+		return;
 
-			struct mp_String* param = &macro->params[i];
-			struct mp_Macro* argm = PE_next_macro(pe);
-			if (argm == NULL)
-				return MP_BAD;
-			argm->name = param->buff;
-			argm->namelen = param->len;
-			argm->def = pe->state.word;
-			argm->deflen = pe->state.wlen;
-			argc++;
-
-			if (ret == MP_END)
-				break;
+	// object-like: "#define Y X"
+	if (macro->isfunc == MP_FALSE) {
+		if (namelen == len) {
+			macro->fwdname = def;
+			macro->fwdnamelen = namelen;
 		}
+		return;
+	}
 
-		char* outbuff = malloc(sizeof(char) * MP_MAX_DEF_LEN);
-
-		struct mp_ProcessState oldps = pe->state;
-		struct mp_ProcessContext oldpc = pe->ctx;
-		pe->ctx.src = macro->def;
-		pe->ctx.readlen = macro->deflen;
-		pe->ctx.outBuff = outbuff;
-		pe->ctx.endch = MP_ENDCH_NONE;
-		PE_reset_state(pe);
-		if (process(pe, MP_FALSE, MP_FALSE) == MP_BAD) {
-			free(outbuff);
-			return MP_BAD;
-		}
-		oldps.word = outbuff;
-		oldps.wlen = pe->state.outofs;
-		pe->ctx = oldpc;
-		pe->state = oldps;
+	// function-like: "#define B(c,d) A(d,c)"
+	if (macro_param_index(macro, def, namelen) != macro->paramc) // shadowed by a parameter
+		return;
+	size_t i = cstr_skip_Hws(def, len, namelen);
+	if (
+		(i >= len) ||
+		(def[i] != '(')
+	) return;
 
-		// TODO this sucks, wasting memory
-		for (size_t i = 0; i < argc; i++)
-			pe->macros[oldmacrostop + i].namelen = 0; // ignore macro arguments
+	size_t* args = &pe->fwdargs[pe->fwdargstop];
+	size_t argc = 0;
+	for (i++;;) {
+		i = cstr_skip_Hws(def, len, i);
+		size_t wlen = cstr_wordlen(&def[i], len - i);
+		if (wlen == 0)
+			return;
+		size_t param = macro_param_index(macro, &def[i], wlen);
+		if (param == macro->paramc)
+			return;
+		if (pe->fwdargstop + argc >= MP_MAX_MACROS)
+			return;
+		args[argc++] = param;
 
+		i = cstr_skip_Hws(def, len, i + wlen);
+		if (i >= len)
+			return;
+		if (def[i++] == ')')
+			break;
+		if (def[i - 1] != ',')
+			return;
+	}
+	if (i != len) // trailing characters
+		return;
+
+	pe->fwdargstop += argc;
+	macro->fwdname = def;
+	macro->fwdnamelen = namelen;
+	macro->fwdargs = args;
+	macro->fwdargc = argc;
+}
+
+// resolve the final target of a forwarding macro
+// returns macro/NULL if not forwarding
+static struct mp_Macro* PE_resolve_fwd (struct mp_ProcessEnv* pe, struct mp_Macro* macro)
+{
+	if (macro->fwdname == NULL)
+		return NULL;
+	if (macro->fwdgen == pe->defgen)
+		return macro->fwd;
+
+	// every definition invalidates all resolved chains
+	if (pe->fwdmapgen != pe->defgen) {
+		pe->fwdmapgen = pe->defgen;
+		pe->fwdmapstop = 0;
+	}
+	macro->fwdgen = pe->defgen; // also stops cycles
+	macro->fwd = NULL;
+	macro->fwdmap = NULL;
+
+	struct mp_Macro* next = PE_find_def(pe, macro->fwdname, macro->fwdnamelen);
+	if (
+		(next == NULL) ||
+		(next == macro)
+	) return NULL;
+
+	if (macro->isfunc == MP_FALSE) {
+		struct mp_Macro* target = NULL;
+		if (next->isfunc == MP_FALSE)
+			target = PE_resolve_fwd(pe, next);
+		macro->fwd = (target != NULL) ? target : next;
+		return macro->fwd;
+	}
+
+	if (
+		(next->isfunc == MP_FALSE) ||
+		(next->paramc != macro->fwdargc)
+	) return NULL;
+
+	struct mp_Macro* target = PE_resolve_fwd(pe, next);
+	if (target == NULL)
+		target = next;
+	if (
+		(target == macro) ||
+		(pe->fwdmapstop + target->paramc > MP_MAX_MACROS)
+	) return NULL;
+
+	size_t* map = &pe->fwdmaps[pe->fwdmapstop];
+	for (size_t i = 0; i < target->paramc; i++)
+		map[i] = macro->fwdargs[(target == next) ? i : next->fwdmap[i]];
+	pe->fwdmapstop += target->paramc;
+
+	macro->fwd = target;
+	macro->fwdmap = map;
+	return target;
+}
+
+// returns rope/NULL
+static struct mp_Rope* PE_new_rope (struct mp_ProcessEnv* pe)
+{
+	struct mp_Rope* rope = malloc(sizeof(*rope));
+	if (rope == NULL) {
+		MP_PRINT_PROCESS_ERROR(pe, "Out of memory while expanding macro");
+		return NULL;
+	}
+	mp_rope_init(rope);
+	rope->next = pe->ropes;
+	pe->ropes = rope;
+	return rope;
+}
+
+// process macro's definition into a new rope, with arguments pe->macros[argbase .. argtop) visible
+// store result in pe->state.rope
+// returns MP_OK/MP_BAD
+static int PE_expand_def (struct mp_ProcessEnv* pe, struct mp_Macro* macro, size_t argbase, size_t argtop)
+{
+	if (macro->rope != NULL) { // already expanded
+		pe->state.rope = macro->rope;
 		return MP_OK;
 	}
 
-	char* outbuff = malloc(sizeof(char) * MP_MAX_DEF_LEN);
+	struct mp_Rope* rope = PE_new_rope(pe);
+	if (rope == NULL)
+		return MP_BAD;
 
 	struct mp_ProcessState oldps = pe->state;
 	struct mp_ProcessContext oldpc = pe->ctx;
 	pe->ctx.src = macro->def;
 	pe->ctx.readlen = macro->deflen;
-	pe->ctx.outBuff = outbuff;
+	pe->ctx.nl = macro->nl;
+	pe->ctx.out = rope;
 	pe->ctx.endch = MP_ENDCH_NONE;
+	pe->ctx.istop = MP_FALSE;
 	PE_reset_state(pe);
-	if (process(pe, MP_FALSE, MP_FALSE) == MP_BAD) {
-		free(outbuff);
+	pe->state.argbase = argbase;
+	pe->state.argtop = argtop;
+	if (process(pe) == MP_BAD)
 		return MP_BAD;
-	}
-	oldps.word = outbuff;
-	oldps.wlen = pe->state.outofs;
 	pe->ctx = oldpc;
 	pe->state = oldps;
+	pe->state.rope = rope;
 
 	return MP_OK;
 }
 
+// returns macro/NULL
+static struct mp_Macro* PE_push_arg (struct mp_ProcessEnv* pe, const struct mp_String* param, const struct mp_Macro* value)
+{
+	struct mp_Macro* argm = PE_next_macro(pe);
+	if (argm == NULL)
+		return NULL;
+	argm->name = param->buff;
+	argm->namelen = param->len;
+	argm->def = value->def;
+	argm->deflen = value->deflen;
+	argm->nl = value->nl;
+	argm->rope = value->rope;
+	argm->isarg = MP_TRUE;
+	argm->argbase = value->argbase;
+	argm->argtop = value->argtop;
+	return argm;
+}
+
+// expand macro
+// store result in pe->state.rope
+// returns MP_OK/MP_BAD
+static int PE_expand_macro (struct mp_ProcessEnv* pe, struct mp_Macro* macro)
+{
+	if (macro->isarg == MP_TRUE)
+		return PE_expand_def(pe, macro, macro->argbase, macro->argtop);
+
+	if (
+		(macro->isfunc == MP_FALSE) ||
+		(PE_char(pe) != '(')
+	) {
+		if (macro->isfunc == MP_FALSE) {
+			struct mp_Macro* target = PE_resolve_fwd(pe, macro);
+			if (target != NULL)
+				macro = target;
+		}
+		return PE_expand_def(pe, macro, pe->macrostop, pe->macrostop);
+	}
+	PE_advance(pe);
+
+	size_t oldmacrostop = pe->macrostop;
+	struct mp_Snapshot snap = mp_PE_snapshot(pe);
+	size_t argc = 0;
+
+	// turn arguments into macros, calculate argc
+	for (;;) {
+		int ret = PE_next_delim(pe, MP_DELIM_ARGS);
+		if (ret == MP_BAD)
+			return MP_BAD;
+
+		if (argc >= macro->paramc) {
+			MP_PRINT_PROCESS_ERROR(pe, "Too many arguments for macro \"%.*s\"", macro->namelen, macro->name);
+			return MP_BAD;
+		}
+		struct mp_Macro value;
+		value.def = pe->state.word;
+		value.deflen = pe->state.wlen;
+		value.nl = (pe->ctx.nl == MP_NL_LF) ? MP_NL_LF : MP_NL_MIXED; // part of the current source
+		value.rope = pe->state.rope;
+		value.argbase = pe->state.argbase;
+		value.argtop = pe->state.argtop;
+		if (PE_push_arg(pe, &macro->params[argc], &value) == NULL)
+			return MP_BAD;
+		argc++;
+
+		if (ret == MP_END)
+			break;
+	}
+
+	size_t argbase = oldmacrostop;
+	struct mp_Macro* target = PE_resolve_fwd(pe, macro);
+	if (
+		(target != NULL) &&
+		(argc == macro->paramc)
+	) { // bind the arguments straight to the target's parameters
+		argbase = pe->macrostop;
+		for (size_t i = 0; i < target->paramc; i++)
+			if (PE_push_arg(pe, &target->params[i], &pe->macros[oldmacrostop + macro->fwdmap[i]]) == NULL)
+				return MP_BAD;
+		macro = target;
+	}
+
+	int ret = PE_expand_def(pe, macro, argbase, pe->macrostop);
+	mp_PE_restore(pe, &snap); // drop macro arguments, and definitions made meanwhile, which were above them
+	return ret;
+}
+
 // read all characters from start to )/,/EOF
 // result stored in pe->state.word and pe->state.wlen
 static void PE_read_delim (struct mp_ProcessEnv* pe, const char* start)
@@ -369,12 +846,12 @@ static void PE_read_delim (struct mp_ProcessEnv* pe, const char* start)
 		(pe->state.eof == MP_FALSE)
 	) c = PE_advance(pe);
 	pe->state.word = start;
-	pe->state.wlen = PE_charPtr(pe) - start - pe->state.nllen;
+	pe->state.wlen = PE_charPtr(pe) - start;
 }
 
 // opening '(' must be read
 // read arg (what == MP_DELIM_ARGS) or param (what == MP_DELIM_PARAMS)
-// result stored in pe->state.word and pe->state.wlen
+// result stored in pe->state.word and pe->state.wlen, or pe->state.rope if expanded
 // returns MP_OK/MP_BAD or MP_END if ended
 static int PE_next_delim (struct mp_ProcessEnv* pe, enum mp_DelimWhat what)
 {
@@ -394,17 +871,12 @@ static int PE_next_delim (struct mp_ProcessEnv* pe, enum mp_DelimWhat what)
 	}
 	else { // MP_DELIM_ARGS
 		const char* start = PE_charPtr(pe);
+		pe->state.rope = NULL;
 		if (PE_word(pe) == MP_OK) { // macro/result
 			struct mp_Macro* macro = PE_find_macro(pe, pe->state.word, pe->state.wlen);
 			if (macro != NULL) {
-				if (PE_expand_macro(pe, macro) == MP_OK) { // result
-					if (pe->tofreetop >= MP_MAX_MACRO_EXPS) {
-						MP_PRINT_PROCESS_ERROR(pe, "Maximum number of macro expansions (%u) exceeded", MP_MAX_MACRO_EXPS);
-						return MP_BAD;
-					}
-					pe->tofree[pe->tofreetop++] = pe->state.word; // allocated expanded definition, free later
-				}
-				else PE_read_delim(pe, start); // result
+				if (PE_expand_macro(pe, macro) == MP_BAD)
+					return MP_BAD;
 			}
 			else PE_read_delim(pe, start); // result
 		}
@@ -431,12 +903,264 @@ static int PE_next_delim (struct mp_ProcessEnv* pe, enum mp_DelimWhat what)
  * 
  */
 
+/*
+ *
+ * PE :: Scanner
+ *
+ */
+
+// add new definitions to the scanner
+// returns MP_OK/MP_BAD
+static int PE_update_scanner (struct mp_ProcessEnv* pe)
+{
+	struct mp_Scanner* sc = &pe->scanner;
+	if (sc->defc > pe->macrostop) { // definitions dropped, start over
+		mp_scanner_free(sc);
+		if (mp_scanner_init(sc) == MP_BAD)
+			return MP_BAD;
+	}
+	for (; sc->defc < pe->macrostop; sc->defc++) {
+		struct mp_Macro* macro = &pe->macros[sc->defc];
+		if (macro->isarg == MP_FALSE)
+		if (mp_scanner_add(sc, macro->name, macro->namelen) == MP_BAD)
+			return MP_BAD;
+	}
+	return MP_OK;
+}
+
+// jump to the next candidate
+static void PE_jump_cand (struct mp_ProcessEnv* pe)
+{
+	const struct mp_Candidate* cand = &pe->cands->cands[pe->candi];
+	while (cand->ofs <= pe->state.srcofs)
+		cand = &pe->cands->cands[++pe->candi];
+
+	if (cand->ofs >= pe->ctx.readlen) {
+		pe->state.srcofs = pe->ctx.readlen;
+		pe->state.eof = MP_TRUE;
+	}
+	else pe->state.srcofs = cand->ofs;
+	pe->state.ln = cand->ln;
+	pe->state.lnsidx = cand->lnsidx;
+}
+
+// skip to the next word naming a definition, or instruction
+// returns MP_OK, MP_BAD if the scanner can't be used
+static int PE_scan (struct mp_ProcessEnv* pe)
+{
+	if (
+		(pe->ctx.istop == MP_FALSE) || // arguments aren't scanned for
+		(pe->ctx.endch != MP_ENDCH_NONE) ||
+		(pe->state.isinstr == MP_TRUE)
+	) return MP_BAD;
+
+	if (pe->cands != NULL) {
+		PE_jump_cand(pe);
+		return MP_OK;
+	}
+
+	if (pe->usescanner == MP_FALSE)
+		return MP_BAD;
+	if (PE_update_scanner(pe) == MP_BAD) {
+		MP_PRINT_WARNING("Out of memory while building the scanner, continuing without");
+		mp_scanner_free(&pe->scanner);
+		pe->usescanner = MP_FALSE;
+		return MP_BAD;
+	}
+
+	PE_jump(pe, mp_scanner_next(&pe->scanner, pe->ctx.src, pe->ctx.readlen, pe->state.srcofs + 1));
+	return MP_OK;
+}
+
+/*
+ *
+ * Would processing the source just copy it?
+ * True if there are no instructions, and no words naming a definition.
+ *
+ */
+MP_BOOL mp_PE_passthrough (struct mp_ProcessEnv* pe)
+{
+	const char* src = pe->ctx.src;
+	size_t len = pe->ctx.readlen;
+	if (pe->ctx.endch != MP_ENDCH_NONE)
+		return MP_FALSE;
+	if (memchr(src, MP_INSTRUCTION_PREFIX, len) != NULL)
+		return MP_FALSE;
+	if (pe->defs.count == 0)
+		return MP_TRUE;
+
+	if (
+		(pe->usescanner == MP_TRUE) &&
+		(PE_update_scanner(pe) == MP_OK)
+	) return (mp_scanner_next(&pe->scanner, src, len, 0) == len) ? MP_TRUE : MP_FALSE;
+
+	for (size_t i = 0; i < len;) {
+		if (!is_wordbegc(src[i])) {
+			i++;
+			continue;
+		}
+		size_t wlen = cstr_wordlen(&src[i], len - i);
+		if (PE_find_def(pe, &src[i], wlen) != NULL)
+			return MP_FALSE;
+		i += wlen;
+	}
+	return MP_TRUE;
+}
+
 int mp_process (struct mp_ProcessEnv* pe)
 {
-	return process(pe, MP_TRUE, MP_TRUE);
+	return process(pe);
+}
+
+/*
+ *
+ * Variants
+ *
+ * Several environments processing the same source, each with its own definitions, share one scan of it.
+ * Positions where any of them could do something other than copy (instructions, and words naming a definition
+ * in any of them) are collected once, the environments jump between those instead of scanning the literal text.
+ *
+ */
+
+// add names defined by the "#define <name>" instructions in 'str' (of length 'len') to the scanner
+// returns MP_OK/MP_BAD
+static int scanner_add_defined (struct mp_Scanner* sc, const char* str, size_t len)
+{
+	const char* end = str + len;
+	const char* p = memchr(str, MP_INSTRUCTION_PREFIX, len);
+	while (p != NULL) {
+		// the first word after the prefix is the instruction, see process()
+		while (
+			(p < end) &&
+			(!is_wordbegc(*p))
+		) p++;
+		size_t wlen = cstr_wordlen(p, end - p);
+		if (mp_cstr_eq(p, wlen, "define", 6) == MP_TRUE) {
+			p = &str[cstr_skip_Hws(str, len, p + wlen - str)];
+			wlen = cstr_wordlen(p, end - p);
+			if (mp_scanner_add(sc, p, wlen) == MP_BAD)
+				return MP_BAD;
+		}
+		p += wlen;
+		p = memchr(p, MP_INSTRUCTION_PREFIX, end - p);
+	}
+	return MP_OK;
+}
+
+// returns MP_OK/MP_BAD
+static int cands_push (struct mp_Candidates* cands, size_t ofs, size_t ln, size_t lnsidx)
+{
+	if (cands->candc >= cands->candcap) {
+		size_t cap = (cands->candcap == 0) ? 64 : cands->candcap * 2;
+		struct mp_Candidate* arr = realloc(cands->cands, sizeof(*arr) * cap);
+		if (arr == NULL)
+			return MP_BAD;
+		cands->cands = arr;
+		cands->candcap = cap;
+	}
+	struct mp_Candidate* cand = &cands->cands[cands->candc++];
+	cand->ofs = ofs;
+	cand->ln = ln;
+	cand->lnsidx = lnsidx;
+	return MP_OK;
 }
 
-static int process (struct mp_ProcessEnv* pe, MP_BOOL writeNL, MP_BOOL ismain)
+// collect the candidates of the environments' (shared) source
+// names defined since the previous source are added to the scanner, the rest are already there
+// returns MP_OK/MP_BAD
+static int cands_build (struct mp_VariantScan* vscan, struct mp_ProcessEnv* pes[], size_t n)
+{
+	struct mp_Scanner* sc = &vscan->scanner;
+	struct mp_Candidates* cands = &vscan->cands;
+	const char* src = pes[0]->ctx.src;
+	size_t len = pes[0]->ctx.readlen;
+	cands->candc = 0;
+
+	// names defined by any of the environments, or by the source
+	if (scanner_add_defined(sc, src, len) == MP_BAD)
+		return MP_BAD;
+	for (size_t i = 0; i < n; i++) {
+		struct mp_ProcessEnv* pe = pes[i];
+		if (pe->vscandefc > pe->macrostop) // definitions dropped, their names stay as extra candidates
+			pe->vscandefc = pe->macrostop;
+		for (; pe->vscandefc < pe->macrostop; pe->vscandefc++) {
+			struct mp_Macro* macro = &pe->macros[pe->vscandefc];
+			if (macro->isarg == MP_TRUE)
+				continue;
+			if (
+				(mp_scanner_add(sc, macro->name, macro->namelen) == MP_BAD) ||
+				(scanner_add_defined(sc, macro->def, macro->deflen) == MP_BAD) // instructions in definitions
+			) return MP_BAD;
+		}
+	}
+
+	size_t ln = 1;
+	size_t lnsidx = 0;
+	size_t counted = 0; // new lines counted up to
+	for (size_t ofs = 0;;) {
+		size_t cand = mp_scanner_next(sc, src, len, ofs);
+		count_lines(src, counted, cand, pes[0]->ctx.nl, &ln, &lnsidx);
+		counted = cand;
+		if (cands_push(cands, cand, ln, lnsidx) == MP_BAD)
+			return MP_BAD;
+		if (cand >= len)
+			return MP_OK;
+
+		ofs = cand + 1;
+		if (is_wordbegc(src[cand]))
+			ofs = cand + cstr_wordlen(&src[cand], len - cand);
+	}
+}
+
+void mp_vscan_init (struct mp_VariantScan* vscan)
+{
+	vscan->usescanner = (mp_scanner_init(&vscan->scanner) == MP_OK) ? MP_TRUE : MP_FALSE;
+	vscan->cands.cands = NULL;
+	vscan->cands.candc = 0;
+	vscan->cands.candcap = 0;
+}
+
+void mp_vscan_free (struct mp_VariantScan* vscan)
+{
+	mp_scanner_free(&vscan->scanner);
+	vscan->usescanner = MP_FALSE;
+	free(vscan->cands.cands);
+	vscan->cands.cands = NULL;
+	vscan->cands.candc = 0;
+	vscan->cands.candcap = 0;
+}
+
+/*
+ *
+ * Process the same source in every environment, scanning it once.
+ * 'vscan' is kept for the following sources, processed by the same or other environments.
+ * Store mp_process()'s results in 'rets'.
+ *
+ */
+void mp_process_variants (struct mp_VariantScan* vscan, struct mp_ProcessEnv* pes[], int rets[], size_t n)
+{
+	MP_BOOL shared = MP_FALSE;
+	if (
+		(n > 1) &&
+		(vscan->usescanner == MP_TRUE)
+	) {
+		if (cands_build(vscan, pes, n) == MP_OK)
+			shared = MP_TRUE;
+		else {
+			MP_PRINT_WARNING("Out of memory while building the scanner, continuing without");
+			mp_vscan_free(vscan);
+		}
+	}
+
+	for (size_t i = 0; i < n; i++) {
+		pes[i]->cands = (shared == MP_TRUE) ? &vscan->cands : NULL;
+		pes[i]->candi = 0;
+		rets[i] = mp_process(pes[i]);
+		pes[i]->cands = NULL;
+	}
+}
+
+static int process (struct mp_ProcessEnv* pe)
 {
 	for (; !pe->state.eof ;)
 	{
@@ -447,7 +1171,8 @@ static int process (struct mp_ProcessEnv* pe, MP_BOOL writeNL, MP_BOOL ismain)
 		 * 
 		 */
 		if (c == MP_INSTRUCTION_PREFIX) {
-			PE_writeall(pe);
+			if (PE_writeall(pe) == MP_BAD)
+				return MP_BAD;
 			pe->state.isinstr = MP_TRUE;
 			PE_advance(pe);
 		}
@@ -457,7 +1182,8 @@ static int process (struct mp_ProcessEnv* pe, MP_BOOL writeNL, MP_BOOL ismain)
 		 * 
 		 */
 		else if (is_wordbegc(c)) {
-			PE_writeall(pe);
+			if (PE_writeall(pe) == MP_BAD)
+				return MP_BAD;
 			PE_word(pe);
 			if (pe->state.isinstr == MP_TRUE) {
 				pe->state.isinstr = MP_FALSE;
@@ -505,7 +1231,12 @@ static int process (struct mp_ProcessEnv* pe, MP_BOOL writeNL, MP_BOOL ismain)
 					PE_skip_Hws(pe);
 					macro->def = PE_charPtr(pe);
 					PE_skip_line(pe);
-					macro->deflen = PE_charPtr(pe) - macro->def - pe->state.nllen;
+					macro->deflen = PE_charPtr(pe) - macro->def;
+					macro->nl = MP_NL_LF; // a single line, up to its line ending
+					if (mp_hamt_set(&pe->defs, &pe->hamtnodes, macro) == MP_BAD)
+						return MP_BAD;
+					pe->defgen++;
+					PE_analyze_fwd(pe, macro);
 				}
 				else {
 					MP_PRINT_PROCESS_ERROR(pe, "Undefined instruction \"%.*s\"", pe->state.wlen, pe->state.word);
@@ -514,14 +1245,16 @@ static int process (struct mp_ProcessEnv* pe, MP_BOOL writeNL, MP_BOOL ismain)
 			}
 			else {
 				struct mp_Macro* macro = PE_find_macro(pe, pe->state.word, pe->state.wlen);
-				if (PE_expand_macro(pe, macro) == MP_BAD)
-					return MP_BAD;
-				PE_writestr(pe, pe->state.word, pe->state.wlen);
-				if (ismain == MP_TRUE)
-					mp_PE_free(pe);
-				
-				if (writeNL == MP_TRUE)
-					PE_writenl(pe);
+				if (macro == NULL) {
+					if (PE_writestr(pe, pe->state.word, pe->state.wlen) == MP_BAD)
+						return MP_BAD;
+				}
+				else {
+					if (PE_expand_macro(pe, macro) == MP_BAD)
+						return MP_BAD;
+					if (PE_writerope(pe, pe->state.rope) == MP_BAD)
+						return MP_BAD;
+				}
 			}
 		}
 		/*
@@ -532,11 +1265,10 @@ static int process (struct mp_ProcessEnv* pe, MP_BOOL writeNL, MP_BOOL ismain)
 		else {
 			if (pe->state.writestart == NULL)
 				pe->state.writestart = PE_charPtr(pe);
-			PE_advance(pe);
+			if (PE_scan(pe) == MP_BAD)
+				PE_skip_other(pe);
 		}
 	}
 
-	PE_writeall(pe);
-
-	return MP_OK;
+	return PE_writeall(pe);
 }
\ No newline at end of file
@@ -0,0 +1,118 @@
+/*
+ *
+ * rope.c
+ *
+ * Span lists referencing source slices and other ropes,
+ * used to pass expansion results around without copying them.
+ *
+ */
+
+#include "mp.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define MP_ROPE_MIN_SPANS 8
+
+void mp_rope_init (struct mp_Rope* rope)
+{
+	rope->spans = NULL;
+	rope->spanc = 0;
+	rope->spancap = 0;
+	rope->len = 0;
+	rope->next = NULL;
+}
+
+void mp_rope_free (struct mp_Rope* rope)
+{
+	free(rope->spans);
+	mp_rope_init(rope);
+}
+
+// returns MP_OK/MP_BAD
+static int rope_push (struct mp_Rope* rope, struct mp_Span span)
+{
+	if (rope->spanc >= rope->spancap) {
+		size_t cap = (rope->spancap == 0) ? MP_ROPE_MIN_SPANS : rope->spancap * 2;
+		struct mp_Span* spans = realloc(rope->spans, sizeof(*spans) * cap);
+		if (spans == NULL) {
+			MP_PRINT_ERROR("Out of memory while appending to rope");
+			return MP_BAD;
+		}
+		rope->spans = spans;
+		rope->spancap = cap;
+	}
+	rope->spans[rope->spanc++] = span;
+	return MP_OK;
+}
+
+/*
+ *
+ * Append 'len' characters of 'str' to the rope, without copying them.
+ * 'str' has to outlive the rope.
+ *
+ */
+int mp_rope_append_str (struct mp_Rope* rope, const char* str, size_t len)
+{
+	if (len == 0)
+		return MP_OK;
+	rope->len += len;
+
+	// extend the last span if the slices are adjacent
+	if (rope->spanc > 0) {
+		struct mp_Span* last = &rope->spans[rope->spanc - 1];
+		if (
+			(last->str != NULL) &&
+			(last->str + last->len == str)
+		) {
+			last->len += len;
+			return MP_OK;
+		}
+	}
+
+	struct mp_Span span = { str, len, NULL };
+	return rope_push(rope, span);
+}
+
+/*
+ *
+ * Append a reference to 'child' to the rope.
+ * 'child' has to outlive the rope, and must not be modified afterwards.
+ *
+ */
+int mp_rope_append_rope (struct mp_Rope* rope, const struct mp_Rope* child)
+{
+	if (child->len == 0)
+		return MP_OK;
+	// a single span is cheaper to copy than to reference
+	if (child->spanc == 1) {
+		const struct mp_Span* span = &child->spans[0];
+		if (span->str != NULL)
+			return mp_rope_append_str(rope, span->str, span->len);
+		return mp_rope_append_rope(rope, span->rope);
+	}
+
+	rope->len += child->len;
+	struct mp_Span span = { NULL, child->len, child };
+	return rope_push(rope, span);
+}
+
+/*
+ *
+ * Write the rope's contents into 'buff' (of at least rope->len characters).
+ * Returns the number of characters written.
+ *
+ */
+size_t mp_rope_flatten (const struct mp_Rope* rope, char* buff)
+{
+	size_t ofs = 0;
+	for (size_t i = 0; i < rope->spanc; i++) {
+		const struct mp_Span* span = &rope->spans[i];
+		if (span->str != NULL) {
+			memcpy(&buff[ofs], span->str, span->len);
+			ofs += span->len;
+		}
+		else ofs += mp_rope_flatten(span->rope, &buff[ofs]);
+	}
+	return ofs;
+}
@@ -0,0 +1,160 @@
+/*
+ *
+ * scanner.c
+ *
+ * Multi-pattern (Aho-Corasick) automaton finding defined names in the source.
+ *
+ * Only whole words can name a macro, so a match has to begin where a word begins.
+ * All failure transitions therefore lead either back to the root (on a non-word character),
+ * or into a dead state skipping the rest of the word, which leaves a plain DFA over the trie of names.
+ *
+ */
+
+#include "mp.h"
+
+#include <stdlib.h>
+
+#define SYM_OTHER  0  // non-word character
+#define SYM_PREFIX 64 // MP_INSTRUCTION_PREFIX
+
+#define STATE_ROOT 0
+#define STATE_DEAD 1
+
+static unsigned char syms[256];
+
+static void init_syms (void)
+{
+	if (syms['_'] != 0)
+		return;
+	unsigned char sym = 1;
+	syms['_'] = sym++;
+	for (int c = '0'; c <= '9'; c++) syms[c] = sym++;
+	for (int c = 'A'; c <= 'Z'; c++) syms[c] = sym++;
+	for (int c = 'a'; c <= 'z'; c++) syms[c] = sym++;
+	syms[(unsigned char)MP_INSTRUCTION_PREFIX] = SYM_PREFIX;
+}
+
+static inline MP_BOOL is_digit_sym (unsigned char sym) {
+	return (sym >= syms['0']) && (sym <= syms['9']);
+}
+
+// returns the new state, or 0 if out of memory
+static uint32_t new_state (struct mp_Scanner* sc)
+{
+	if (sc->statec >= sc->statecap) {
+		size_t cap = (sc->statecap == 0) ? 64 : sc->statecap * 2;
+		uint32_t* next = realloc(sc->next, sizeof(*next) * MP_SCAN_SYMS * cap);
+		if (next == NULL)
+			return 0;
+		sc->next = next;
+		uint32_t* namelen = realloc(sc->namelen, sizeof(*namelen) * cap);
+		if (namelen == NULL)
+			return 0;
+		sc->namelen = namelen;
+		sc->statecap = cap;
+	}
+
+	uint32_t state = sc->statec++;
+	uint32_t* row = &sc->next[state * MP_SCAN_SYMS];
+	for (size_t sym = 0; sym < MP_SCAN_SYMS; sym++)
+		row[sym] = STATE_DEAD;
+	row[SYM_OTHER] = STATE_ROOT;
+	row[SYM_PREFIX] = STATE_ROOT;
+	sc->namelen[state] = 0;
+	return state;
+}
+
+void mp_scanner_free (struct mp_Scanner* sc)
+{
+	free(sc->next);
+	free(sc->namelen);
+	sc->next = NULL;
+	sc->namelen = NULL;
+	sc->statec = 0;
+	sc->statecap = 0;
+	sc->defc = 0;
+}
+
+// returns MP_OK/MP_BAD
+int mp_scanner_init (struct mp_Scanner* sc)
+{
+	init_syms();
+	sc->next = NULL;
+	sc->namelen = NULL;
+	sc->statec = 0;
+	sc->statecap = 0;
+	sc->defc = 0;
+	new_state(sc); // STATE_ROOT
+	new_state(sc); // STATE_DEAD
+	if (sc->statec != 2) {
+		mp_scanner_free(sc);
+		return MP_BAD;
+	}
+
+	// digits don't begin a word, see process()
+	for (int c = '0'; c <= '9'; c++)
+		sc->next[STATE_ROOT * MP_SCAN_SYMS + syms[c]] = STATE_ROOT;
+	return MP_OK;
+}
+
+/*
+ *
+ * Add the name 'name' (of length 'len') to the automaton
+ * returns MP_OK/MP_BAD
+ *
+ */
+int mp_scanner_add (struct mp_Scanner* sc, const char* name, size_t len)
+{
+	uint32_t state = STATE_ROOT;
+	for (size_t i = 0; i < len; i++) {
+		unsigned char sym = syms[(unsigned char)name[i]];
+		if (
+			(sym == SYM_OTHER) ||
+			(sym == SYM_PREFIX) ||
+			((i == 0) && is_digit_sym(sym))
+		) return MP_OK; // never matches a word
+
+		uint32_t next = sc->next[state * MP_SCAN_SYMS + sym];
+		if (next == STATE_DEAD) {
+			next = new_state(sc);
+			if (next == 0)
+				return MP_BAD;
+			sc->next[state * MP_SCAN_SYMS + sym] = next;
+		}
+		state = next;
+	}
+	sc->namelen[state] = len;
+	return MP_OK;
+}
+
+/*
+ *
+ * Find the next word naming a definition, or MP_INSTRUCTION_PREFIX, in src[ofs .. len)
+ * 'ofs' must not be inside of a word.
+ * Returns its offset, or 'len' if there is none.
+ *
+ */
+size_t mp_scanner_next (const struct mp_Scanner* sc, const char* src, size_t len, size_t ofs)
+{
+	const uint32_t* next = sc->next;
+	const uint32_t* namelen = sc->namelen;
+	uint32_t state = STATE_ROOT;
+
+	for (size_t i = ofs; i < len; i++) {
+		unsigned char sym = syms[(unsigned char)src[i]];
+		if (
+			(sym == SYM_OTHER) ||
+			(sym == SYM_PREFIX)
+		) {
+			if (namelen[state] != 0)
+				return i - namelen[state];
+			if (sym == SYM_PREFIX)
+				return i;
+		}
+		state = next[state * MP_SCAN_SYMS + sym];
+	}
+
+	if (namelen[state] != 0)
+		return len - namelen[state];
+	return len;
+}
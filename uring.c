@@ -0,0 +1,238 @@
+/*
+ *
+ * uring.c
+ *
+ * Minimal io_uring ring on raw system calls, used for batched file I/O (see file.c).
+ *
+ */
+
+#define _GNU_SOURCE // syscall, MAP_POPULATE
+
+#include "mp.h"
+
+#ifdef MP_HAVE_URING
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+struct mp_Ring {
+	int fd;
+	unsigned entries;
+	unsigned tosubmit; // queued, but not yet submitted
+
+	// submission queue
+	unsigned* sqhead;
+	unsigned* sqtail;
+	unsigned* sqmask;
+	unsigned* sqarray;
+	struct io_uring_sqe* sqes;
+
+	// completion queue
+	unsigned* cqhead;
+	unsigned* cqtail;
+	unsigned* cqmask;
+	struct io_uring_cqe* cqes;
+
+	void* sqring;
+	size_t sqringsz;
+	void* cqring; // same as sqring with IORING_FEAT_SINGLE_MMAP
+	size_t cqringsz;
+	size_t sqessz;
+};
+
+static int ring_setup (unsigned entries, struct io_uring_params* p) {
+	return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+static int ring_enter (int fd, unsigned tosubmit, unsigned waitnr, unsigned flags) {
+	return (int)syscall(__NR_io_uring_enter, fd, tosubmit, waitnr, flags, NULL, 0);
+}
+
+// does the kernel support reads and writes (5.6+), older rings only take the vectored ones
+static MP_BOOL ring_supports_rw (int fd)
+{
+	unsigned opc = 256;
+	struct io_uring_probe* probe = calloc(1, sizeof(*probe) + opc * sizeof(*probe->ops));
+	if (probe == NULL)
+		return MP_FALSE;
+	MP_BOOL ret = MP_FALSE;
+	if (
+		(syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, opc) == 0) &&
+		(probe->last_op >= IORING_OP_READ) &&
+		(probe->last_op >= IORING_OP_WRITE) &&
+		(probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED) &&
+		(probe->ops[IORING_OP_WRITE].flags & IO_URING_OP_SUPPORTED)
+	) ret = MP_TRUE;
+	free(probe);
+	return ret;
+}
+
+/*
+ *
+ * Create a ring with 'entries' submission entries
+ * returns ring, or NULL if io_uring, or its reads and writes, aren't available
+ *
+ */
+struct mp_Ring* mp_ring_new (unsigned entries)
+{
+	struct mp_Ring* ring = malloc(sizeof(*ring));
+	if (ring == NULL)
+		return NULL;
+	memset(ring, 0, sizeof(*ring));
+
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+	ring->fd = ring_setup(entries, &p);
+	if (ring->fd < 0) {
+		free(ring);
+		return NULL;
+	}
+	if (ring_supports_rw(ring->fd) == MP_FALSE) {
+		close(ring->fd);
+		free(ring);
+		return NULL;
+	}
+	ring->entries = p.sq_entries;
+
+	ring->sqringsz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	ring->cqringsz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cqringsz > ring->sqringsz)
+			ring->sqringsz = ring->cqringsz;
+		ring->cqringsz = 0;
+	}
+
+	ring->sqring = mmap(NULL, ring->sqringsz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if (ring->sqring == MAP_FAILED) {
+		close(ring->fd);
+		free(ring);
+		return NULL;
+	}
+	ring->cqring = ring->sqring;
+	if (ring->cqringsz != 0) {
+		ring->cqring = mmap(NULL, ring->cqringsz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+		if (ring->cqring == MAP_FAILED) {
+			munmap(ring->sqring, ring->sqringsz);
+			close(ring->fd);
+			free(ring);
+			return NULL;
+		}
+	}
+	ring->sqessz = p.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqessz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED) {
+		if (ring->cqringsz != 0)
+			munmap(ring->cqring, ring->cqringsz);
+		munmap(ring->sqring, ring->sqringsz);
+		close(ring->fd);
+		free(ring);
+		return NULL;
+	}
+
+	char* sq = ring->sqring;
+	ring->sqhead  = (unsigned*)(sq + p.sq_off.head);
+	ring->sqtail  = (unsigned*)(sq + p.sq_off.tail);
+	ring->sqmask  = (unsigned*)(sq + p.sq_off.ring_mask);
+	ring->sqarray = (unsigned*)(sq + p.sq_off.array);
+	char* cq = ring->cqring;
+	ring->cqhead  = (unsigned*)(cq + p.cq_off.head);
+	ring->cqtail  = (unsigned*)(cq + p.cq_off.tail);
+	ring->cqmask  = (unsigned*)(cq + p.cq_off.ring_mask);
+	ring->cqes    = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+
+	return ring;
+}
+
+void mp_ring_free (struct mp_Ring* ring)
+{
+	if (ring == NULL)
+		return;
+	munmap(ring->sqes, ring->sqessz);
+	if (ring->cqringsz != 0)
+		munmap(ring->cqring, ring->cqringsz);
+	munmap(ring->sqring, ring->sqringsz);
+	close(ring->fd);
+	free(ring);
+}
+
+// queue a read/write of 'len' bytes at 'offset'
+// returns MP_OK, MP_BAD if the submission queue is full
+static int ring_queue (struct mp_Ring* ring, int op, int fd, void* buff, unsigned len, uint64_t offset, uint64_t tag)
+{
+	unsigned tail = *ring->sqtail;
+	unsigned head = __atomic_load_n(ring->sqhead, __ATOMIC_ACQUIRE);
+	if (tail - head >= ring->entries)
+		return MP_BAD;
+
+	unsigned idx = tail & *ring->sqmask;
+	struct io_uring_sqe* sqe = &ring->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = op;
+	sqe->fd = fd;
+	sqe->addr = (uint64_t)(uintptr_t)buff;
+	sqe->len = len;
+	sqe->off = offset;
+	sqe->user_data = tag;
+
+	ring->sqarray[idx] = idx;
+	__atomic_store_n(ring->sqtail, tail + 1, __ATOMIC_RELEASE);
+	ring->tosubmit++;
+	return MP_OK;
+}
+
+int mp_ring_read (struct mp_Ring* ring, int fd, void* buff, unsigned len, uint64_t offset, uint64_t tag) {
+	return ring_queue(ring, IORING_OP_READ, fd, buff, len, offset, tag);
+}
+int mp_ring_write (struct mp_Ring* ring, int fd, const void* buff, unsigned len, uint64_t offset, uint64_t tag) {
+	return ring_queue(ring, IORING_OP_WRITE, fd, (void*)buff, len, offset, tag);
+}
+
+/*
+ *
+ * Submit the queued requests, wait for at least 'waitnr' completions
+ * returns MP_OK/MP_BAD
+ *
+ */
+int mp_ring_submit (struct mp_Ring* ring, unsigned waitnr)
+{
+	if (
+		(ring->tosubmit == 0) &&
+		(waitnr == 0)
+	) return MP_OK;
+
+	int ret;
+	do ret = ring_enter(ring->fd, ring->tosubmit, waitnr, (waitnr > 0) ? IORING_ENTER_GETEVENTS : 0);
+	while (
+		(ret < 0) &&
+		(errno == EINTR)
+	);
+	if (ret < 0)
+		return MP_BAD;
+	ring->tosubmit -= ((unsigned)ret < ring->tosubmit) ? (unsigned)ret : ring->tosubmit;
+	return MP_OK;
+}
+
+/*
+ *
+ * Take a completion off the ring
+ * returns MP_TRUE and sets *tag and *res (bytes transferred or -errno), MP_FALSE if there is none
+ *
+ */
+MP_BOOL mp_ring_reap (struct mp_Ring* ring, uint64_t* tag, int* res)
+{
+	unsigned head = *ring->cqhead;
+	if (head == __atomic_load_n(ring->cqtail, __ATOMIC_ACQUIRE))
+		return MP_FALSE;
+
+	struct io_uring_cqe* cqe = &ring->cqes[head & *ring->cqmask];
+	*tag = cqe->user_data;
+	*res = cqe->res;
+	__atomic_store_n(ring->cqhead, head + 1, __ATOMIC_RELEASE);
+	return MP_TRUE;
+}
+
+#endif // MP_HAVE_URING